@@ -1,18 +1,35 @@
 // C++ STL headers
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
 #include <stdexcept>
 #include <system_error>
 // Linux system headers
 #include <sched.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <grp.h>
 #include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/file.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
 // My headers
 #include "util.h"
+#include "rootfs.h"
 #include "log.h"
 
 using namespace std;
@@ -30,6 +47,23 @@ struct Options
     bool mount_sys;
     vector<string> extra_mounts;
     bool mount_program;
+    bool async_cleanup;
+    string result_file;
+    string session_file;
+    string profile_file;
+    string rootfs;
+    string build_rootfs;
+    vector<string> extra_files;
+    bool interactive;
+    bool measure_latency;
+    unsigned int idle_ms;
+    unsigned int idle_interval_ms;
+    unsigned int idle_cpu_percent;
+    string timeline_file;
+    unsigned int timeline_interval_ms;
+    string output_folder;
+    unsigned long long output_size;     // In bytes
+    unsigned long long tmp_size;
 
     Options()
     {
@@ -40,24 +74,47 @@ struct Options
         mount_proc = false;
         mount_sys = false;
         mount_program = true;
+        async_cleanup = false;
+        interactive = false;
+        measure_latency = false;
+        idle_ms = 0;
+        idle_interval_ms = 100;
+        idle_cpu_percent = 1;
+        timeline_interval_ms = 10;
+        output_size = 1ULL << 30;
+        tmp_size = 256ULL << 20;
     }
 
     Options(const Options& o)
      : timeout_ms{o.timeout_ms},
        uid{o.uid}, gid{o.gid}, debug{o.debug},
        mount_proc{o.mount_proc}, mount_sys{o.mount_sys},
-       extra_mounts{o.extra_mounts}, mount_program{o.mount_program}
+       extra_mounts{o.extra_mounts}, mount_program{o.mount_program},
+       async_cleanup{o.async_cleanup}, result_file{o.result_file},
+       session_file{o.session_file}, profile_file{o.profile_file},
+       rootfs{o.rootfs}, build_rootfs{o.build_rootfs}, extra_files{o.extra_files},
+       interactive{o.interactive}, measure_latency{o.measure_latency},
+       idle_ms{o.idle_ms}, idle_interval_ms{o.idle_interval_ms},
+       idle_cpu_percent{o.idle_cpu_percent}, timeline_file{o.timeline_file},
+       timeline_interval_ms{o.timeline_interval_ms}, output_folder{o.output_folder},
+       output_size{o.output_size}, tmp_size{o.tmp_size}
     {
     }
 
+    Options& operator=(const Options& o) = default;
+
     static void Usage(const char* prog);
-    static Options Parse(int& argc, char**& argv);
+    static Options Parse(int& argc, char**& argv, const Options& defaults = Options());
+    vector<string> ParseSessionCommand(const string& line);
     void Log();
 };
 
 void Options::Usage(const char* prog)
 {
     cerr << "Usage: " << prog << " [OPTIONS] COMMAND\n";
+    cerr << "       " << prog << " [OPTIONS] -S file\n";
+    cerr << "       " << prog << " [OPTIONS] -i COMMAND -- [OPTIONS] INTERACTOR\n";
+    cerr << "       " << prog << " -B folder [-x file]... PROGRAM\n";
     cerr << "\n";
     cerr << "OPTIONS:\n";
     cerr << "    -d         Enable debug messages\n";
@@ -68,19 +125,127 @@ void Options::Usage(const char* prog)
     cerr << "    -s         Mount /sys\n";
     cerr << "    -m path    Mount path under /mnt/`basename path`\n";
     cerr << "    -M         Do not mount program\n";
+    cerr << "    -o folder  Mount a writable folder under /mnt/`basename folder`\n";
+    cerr << "               and move what the program writes there to folder\n";
+    cerr << "    --output-size SIZE\n";
+    cerr << "               Kill the program once it wrote more than SIZE bytes\n";
+    cerr << "               to the -o folder (k, m and g suffixes allowed),\n";
+    cerr << "               default 1g\n";
+    cerr << "    -a         Return as soon as the program exits, clean up in background\n";
+    cerr << "    -r file    Write the result (status, resource usage) to file\n";
+    cerr << "    -S file    Session mode, run the commands read from file\n";
+    cerr << "    --tmp-size SIZE\n";
+    cerr << "               Limit the /tmp of -S and -o to SIZE bytes (k, m\n";
+    cerr << "               and g suffixes allowed), default 256m\n";
+    cerr << "    -P file, --profile-syscalls file\n";
+    cerr << "               Write the count and total time of each system call\n";
+    cerr << "               made by the program to file, most expensive first\n";
+    cerr << "    -R folder, --rootfs folder\n";
+    cerr << "               Mount the folders in folder instead of the host's\n";
+    cerr << "               /bin, /etc, /lib, /lib32, /lib64 and /usr\n";
+    cerr << "    -B folder, --build-rootfs folder\n";
+    cerr << "               Do not run anything, build a folder for -R with\n";
+    cerr << "               PROGRAM and its shared libraries in folder\n";
+    cerr << "    -x file, --extra-file file\n";
+    cerr << "               Add file (and its shared libraries) to the folder\n";
+    cerr << "               built by -B\n";
+    cerr << "    -i         Interactive mode, connect COMMAND and INTERACTOR\n";
+    cerr << "    -L         Relay the messages of -i and measure round trips\n";
+    cerr << "    -I T, --idle T\n";
+    cerr << "               Kill the program if it used less than P% of a CPU\n";
+    cerr << "               during the last T milliseconds\n";
+    cerr << "    --idle-cpu P\n";
+    cerr << "               Set P for -I, default 1\n";
+    cerr << "    --idle-interval T\n";
+    cerr << "               Check the CPU time for -I every T milliseconds,\n";
+    cerr << "               default 100\n";
+    cerr << "    -T file, --timeline file\n";
+    cerr << "               Write samples of the memory, CPU time, context\n";
+    cerr << "               switches and I/O of the program to file as CSV\n";
+    cerr << "    --timeline-interval T\n";
+    cerr << "               Sample for -T every T milliseconds, default 10\n";
     cerr << "\n";
     cerr << "The -m option can be repeated to mount multiple paths.\n";
     cerr << "If the -M option is not specified, the program is mounted at\n";
     cerr << "/program which is useful for programs that are not installed\n";
     cerr << "in standard locations such as /bin or /usr/bin\n";
     cerr << "\n";
+    cerr << "The exit status is the program's exit status, or 128 + signal\n";
+    cerr << "number if it was killed by a signal.\n";
+    cerr << "\n";
+    cerr << "In session mode the sandbox is set up once and the commands read\n";
+    cerr << "from file (e.g. a named pipe), one per line, are run one by one.\n";
+    cerr << "A command line is [-t T] [-I T] PROGRAM [ARGS...], where PROGRAM is an\n";
+    cerr << "absolute path inside the sandbox. Commands share a writable /tmp,\n";
+    cerr << "which is also their working folder. One result per command is\n";
+    cerr << "written to the -r file.\n";
+    cerr << "\n";
+    cerr << "The -B option prints the path of the folder it built. Folders are\n";
+    cerr << "named after the hash of their contents and reused if they exist.\n";
+    cerr << "\n";
+    cerr << "In interactive mode COMMAND and INTERACTOR run in two sandboxes,\n";
+    cerr << "the stdout of each connected to the stdin of the other. The options\n";
+    cerr << "after -- apply to INTERACTOR, which inherits only -d, -u and -g.\n";
+    cerr << "If either one breaks its limits, the other one is killed too. Both\n";
+    cerr << "results are written to the -r file, the exit status is COMMAND's.\n";
+    cerr << "\n";
 }
 
-Options Options::Parse(int& argc, char**& argv)
+/* Codes of the long options without a short one */
+enum { idle_cpu_option = 256, idle_interval_option, timeline_interval_option,
+       tmp_size_option, output_size_option };
+
+static unsigned int ParsePositive(const char* value, const string& what)
 {
+    int n = atoi(value);
+    if (n <= 0)
+    {
+        throw runtime_error("Error parsing options: " + what + " must be positive");
+    }
+    return n;
+}
+
+/* Parses a number of bytes with an optional k, m or g suffix */
+static unsigned long long ParseSize(const char* value, const string& what)
+{
+    string size = value;
+    const string suffixes = "kmg";
+    size_t digits = size.find_first_not_of("0123456789");
+    if (digits == 0 || (digits != string::npos &&
+                        (digits != size.size() - 1 || suffixes.find(size[digits]) == string::npos)))
+    {
+        throw runtime_error("Error parsing options: invalid " + what + " " + size);
+    }
+    errno = 0;
+    unsigned long long bytes = strtoull(value, nullptr, 10);
+    unsigned int shift = (digits == string::npos) ? 0 : 10 * (suffixes.find(size[digits]) + 1);
+    if (bytes == 0 || errno == ERANGE || bytes > (ULLONG_MAX >> shift))
+    {
+        throw runtime_error("Error parsing options: " + what + " must be positive and fit in 64 bits");
+    }
+    return bytes << shift;
+}
+
+Options Options::Parse(int& argc, char**& argv, const Options& defaults)
+{
+    static const struct option long_options[] = {
+        { "profile-syscalls", required_argument, nullptr, 'P' },
+        { "rootfs", required_argument, nullptr, 'R' },
+        { "build-rootfs", required_argument, nullptr, 'B' },
+        { "extra-file", required_argument, nullptr, 'x' },
+        { "idle", required_argument, nullptr, 'I' },
+        { "idle-cpu", required_argument, nullptr, idle_cpu_option },
+        { "idle-interval", required_argument, nullptr, idle_interval_option },
+        { "timeline", required_argument, nullptr, 'T' },
+        { "timeline-interval", required_argument, nullptr, timeline_interval_option },
+        { "tmp-size", required_argument, nullptr, tmp_size_option },
+        { "output-size", required_argument, nullptr, output_size_option },
+        { nullptr, 0, nullptr, 0 }
+    };
     int opt;
-    Options options;
-    while ((opt = getopt(argc, argv, "+dt:u:g:psm:M")) != -1) {
+    Options options = defaults;
+    optind = 0;     // We may be called again for the interactor's options
+    while ((opt = getopt_long(argc, argv, "+dt:u:g:psm:Mo:ar:S:P:R:B:x:iLI:T:", long_options, nullptr)) != -1) {
         switch (opt) {
             case 'd':   options.debug = true;   break;
             case 't':
@@ -102,6 +267,35 @@ Options Options::Parse(int& argc, char**& argv)
             case 's':   options.mount_sys = true;       break;
             case 'm':   options.extra_mounts.push_back(optarg); break;
             case 'M':   options.mount_program = false;  break;
+            case 'o':   options.output_folder = optarg; break;
+            case output_size_option:
+                options.output_size = ParseSize(optarg, "output size");
+                break;
+            case 'a':   options.async_cleanup = true;   break;
+            case 'r':   options.result_file = optarg;   break;
+            case 'S':   options.session_file = optarg;  break;
+            case tmp_size_option:
+                options.tmp_size = ParseSize(optarg, "/tmp size");
+                break;
+            case 'P':   options.profile_file = optarg;  break;
+            case 'R':   options.rootfs = optarg;        break;
+            case 'B':   options.build_rootfs = optarg;  break;
+            case 'x':   options.extra_files.push_back(optarg);  break;
+            case 'i':   options.interactive = true;     break;
+            case 'L':   options.measure_latency = true; break;
+            case 'I':
+                options.idle_ms = ParsePositive(optarg, "idle time");
+                break;
+            case idle_cpu_option:
+                options.idle_cpu_percent = ParsePositive(optarg, "idle CPU percentage");
+                break;
+            case idle_interval_option:
+                options.idle_interval_ms = ParsePositive(optarg, "idle check interval");
+                break;
+            case 'T':   options.timeline_file = optarg; break;
+            case timeline_interval_option:
+                options.timeline_interval_ms = ParsePositive(optarg, "timeline interval");
+                break;
             default:
             {
                 Usage(argv[0]);
@@ -114,6 +308,56 @@ Options Options::Parse(int& argc, char**& argv)
     return options;
 }
 
+/* Applies the per-command options at the start of a session command line
+ * and returns the rest of it, i.e. the command to execute */
+vector<string> Options::ParseSessionCommand(const string& line)
+{
+    istringstream iss(line);
+    vector<string> tokens;
+    string token;
+    while (iss >> token)
+    {
+        tokens.push_back(token);
+    }
+    size_t i = 0;
+    while (i < tokens.size() && tokens[i][0] == '-')
+    {
+        if (tokens[i] == "-t" && i + 1 < tokens.size())
+        {
+            int t = atoi(tokens[i + 1].c_str());
+            if (t <= 0)
+            {
+                throw runtime_error("Error parsing session command: timeout value must be positive");
+            }
+            timeout_ms = t;
+            i += 2;
+        }
+        else if (tokens[i] == "-I" && i + 1 < tokens.size())
+        {
+            int t = atoi(tokens[i + 1].c_str());
+            if (t <= 0)
+            {
+                throw runtime_error("Error parsing session command: idle time must be positive");
+            }
+            if (!profile_file.empty())
+            {
+                throw runtime_error("Error parsing session command: -I cannot be used with -P");
+            }
+            idle_ms = t;
+            i += 2;
+        }
+        else
+        {
+            throw runtime_error("Error parsing session command: unknown option " + tokens[i]);
+        }
+    }
+    if (i == tokens.size())
+    {
+        throw runtime_error("Error parsing session command: missing command to execute");
+    }
+    return vector<string>(tokens.begin() + i, tokens.end());
+}
+
 void Options::Log()
 {
     log << boolalpha;
@@ -130,21 +374,137 @@ void Options::Log()
         log << "    " << x << "\n";
     }
     log << "  Mount program: " << mount_program << "\n";
+    log << "  Output folder: " << output_folder << " (" << output_size << " bytes)\n";
+    log << "  Async cleanup: " << async_cleanup << "\n";
+    log << "  Result file: " << result_file << "\n";
+    log << "  Session file: " << session_file << " (/tmp: " << tmp_size << " bytes)\n";
+    log << "  Syscall profile: " << profile_file << "\n";
+    log << "  Rootfs: " << (rootfs.empty() ? "host" : rootfs) << "\n";
+    log << "  Idle: " << idle_ms << " ms, below " << idle_cpu_percent << "% CPU, checked every "
+        << idle_interval_ms << " ms\n";
+    log << "  Timeline: " << timeline_file << ", every " << timeline_interval_ms << " ms\n";
+}
+
+int ExitCode(const ExecResult& result)
+{
+    if (WIFSIGNALED(result.status))
+    {
+        return 128 + WTERMSIG(result.status);
+    }
+    return WEXITSTATUS(result.status);
+}
+
+/* has_output tells whether the program was run with -o */
+void WriteResult(ostream& os, const ExecResult& result, bool has_output)
+{
+    if (WIFSIGNALED(result.status))
+    {
+        os << "status: signaled " << WTERMSIG(result.status) << "\n";
+    }
+    else
+    {
+        os << "status: exited " << WEXITSTATUS(result.status) << "\n";
+    }
+    switch (result.verdict)
+    {
+        case Verdict::Exited:       os << "verdict: ok\n";         break;
+        case Verdict::TimeLimit:    os << "verdict: timeout\n";    break;
+        case Verdict::Invalid:      os << "verdict: invalid\n";    break;
+        case Verdict::Killed:       os << "verdict: killed\n";     break;
+        case Verdict::Idle:         os << "verdict: idle\n";       break;
+        case Verdict::OutputLimit:  os << "verdict: output_limit\n"; break;
+    }
+    if (has_output)
+    {
+        os << "output: " << (result.output_error ? strerror(result.output_error) : "ok") << "\n";
+    }
+    os << "user_time_ms: " << result.usage.ru_utime.tv_sec * 1000 + result.usage.ru_utime.tv_usec / 1000 << "\n";
+    os << "system_time_ms: " << result.usage.ru_stime.tv_sec * 1000 + result.usage.ru_stime.tv_usec / 1000 << "\n";
+    os << "max_rss_kb: " << result.usage.ru_maxrss << "\n";
+    os << "voluntary_context_switches: " << result.usage.ru_nvcsw << "\n";
+    os << "involuntary_context_switches: " << result.usage.ru_nivcsw << "\n";
+}
+
+struct TimelineSample
+{
+    unsigned long long time_ms;     // Since the sandbox started
+    ProcessStats stats;
+};
+
+/* Writes the samples of a ring buffer that count samples were put in */
+void WriteTimeline(ostream& os, const vector<TimelineSample>& ring, size_t count)
+{
+    os << "time_ms,processes,cpu_ms,rss_kb,voluntary_switches,involuntary_switches,"
+          "rchar,wchar\n";
+    size_t first = (count > ring.size()) ? count - ring.size() : 0;
+    for (size_t i = first; i < count; i++)
+    {
+        const TimelineSample& sample = ring[i % ring.size()];
+        os << sample.time_ms << "," << sample.stats.processes << "," << sample.stats.cpu_ms << ","
+           << sample.stats.rss_kb << "," << sample.stats.voluntary_switches << ","
+           << sample.stats.involuntary_switches << "," << sample.stats.rchar << ","
+           << sample.stats.wchar << "\n";
+    }
+}
+
+void WriteSyscallProfile(ostream& os, const SyscallProfile& profile)
+{
+    vector<long> syscalls;
+    for (size_t nr = 0; nr < profile.size(); nr++)
+    {
+        if (profile[nr].count > 0)
+        {
+            syscalls.push_back(nr);
+        }
+    }
+    sort(syscalls.begin(), syscalls.end(), [&](long a, long b) {
+        if (profile[a].total_ns != profile[b].total_ns)
+        {
+            return profile[a].total_ns > profile[b].total_ns;
+        }
+        return profile[a].count > profile[b].count;
+    });
+    os << "# syscall calls total_us\n";
+    for (auto nr : syscalls)
+    {
+        os << SyscallName(nr) << " " << profile[nr].count << " "
+           << profile[nr].total_ns / 1000 << "\n";
+    }
 }
 
 class Sandbox
 {
   public:
-    explicit Sandbox(Options options_) : options{options_}, ctor_pid{getpid()}
+    explicit Sandbox(Options options_)
+     : options{options_}, owner_pid{getpid()}, result_fd{-1}, null_fd{-1},
+       session_input{nullptr}, profile_fd{-1}, proc_fd{-1}, timeline_fd{-1},
+       timeline_count{0}, runner_pid{-1}, result_read_fd{-1}, ready_fd{-1},
+       stdin_fd{-1}, stdout_fd{-1}, output_fd{-1}, staging_fd{-1}
     {
         log << "\n[" << getpid() << "] Sandbox():\n";
-        rootfs = CreateTempFolder("/tmp/sandbox_");
+        rootfs = CreateTempFolder(string(temp_folder) + "/" + temp_prefix);
         ChangeMode(rootfs, 0755);
+        // Held for the lifetime of the sandbox, tells us apart from stale ones
+        lock_fd = LockPath(rootfs);
         log << " rootfs = " << rootfs << "\n";
         CreatePrivateMount(rootfs);
-        for (auto& folder : always_mount)
+        if (options.rootfs.empty())
+        {
+            system_folders = always_mount;
+        }
+        else
         {
-            if (PathExists(folder))
+            for (auto& name : ListFolder(options.rootfs))
+            {
+                if (IsDirectory(options.rootfs + "/" + name) && !IsReserved(name))
+                {
+                    system_folders.push_back("/" + name);
+                }
+            }
+        }
+        for (auto& folder : system_folders)
+        {
+            if (PathExists(options.rootfs + folder))
             {
                 string mount_point = rootfs + folder;
                 log << " Creating folder " << mount_point << "\n";
@@ -168,6 +528,18 @@ class Sandbox
                 pfs.close();
             }
         }
+        if (!options.output_folder.empty())
+        {
+            output_path = "/mnt/" + BaseName(options.output_folder);
+            output_mount_point = rootfs + output_path;
+            log << " Creating folder " << output_mount_point << "\n";
+            CreateFolder(output_mount_point);
+        }
+        if (HasTmp())
+        {
+            log << " Creating folder " << rootfs + "/tmp" << "\n";
+            CreateFolder(rootfs + "/tmp");
+        }
         if (options.mount_program)
         {
             program_mount_point = rootfs + program_path;
@@ -179,82 +551,403 @@ class Sandbox
 
     ~Sandbox()
     {
-        if (getpid() == ctor_pid)
+        if (getpid() == owner_pid)
+        {
+            Cleanup();
+        }
+    }
+
+    using ResultHandler = function<void(const ExecResult&)>;
+
+    /* Runs the command, or the session's commands if args is null, and
+     * calls handler with each result as soon as it is available */
+    void RunCommand(char* args[], ResultHandler handler)
+    {
+        Start(args);
+        ExecResult result;
+        unsigned int count = 0;
+        while (NextResult(result))
+        {
+            handler(result);
+            count++;
+        }
+        Finish();
+        if (count == 0 && !InSession())
+        {
+            throw runtime_error("RunCommand, sandbox exited without reporting a result");
+        }
+    }
+
+    /* Gives the program in_fd and out_fd as stdin and stdout. All other
+     * descriptors of ours are closed inside the sandbox. Call before Start */
+    void SetStdio(int in_fd, int out_fd)
+    {
+        stdin_fd = in_fd;
+        stdout_fd = out_fd;
+    }
+
+    /* Starts the sandbox in the background, see RunCommand */
+    void Start(char* args[])
+    {
+        if (InSession())
+        {
+            session_input = fdopen(OpenAsRealUser(options.session_file, O_RDONLY), "r");
+            if (session_input == nullptr)
+            {
+                throw system_error(errno, system_category(), "Start, fdopen() failed");
+            }
+        }
+        if (!options.profile_file.empty())
+        {
+            profile_fd = OpenAsRealUser(options.profile_file, O_WRONLY | O_CREAT | O_TRUNC);
+        }
+        if (!options.timeline_file.empty())
+        {
+            timeline_fd = OpenAsRealUser(options.timeline_file, O_WRONLY | O_CREAT | O_TRUNC);
+        }
+        if (!options.output_folder.empty())
+        {
+            output_fd = OpenAsRealUser(options.output_folder, O_RDONLY | O_DIRECTORY);
+            // On the same file system as the results, so that they can be renamed there
+            string staging;
+            RunAsRealUser([&]() {
+                staging = CreateTempFolder(options.output_folder + "/" + staging_prefix);
+            });
+            staging_name = BaseName(staging);
+            staging_fd = OpenAsRealUser(staging, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+            // Held until the staging folder is gone, like lock_fd for rootfs
+            if (flock(staging_fd, LOCK_EX) < 0 || fchown(staging_fd, options.uid, options.gid) < 0)
+            {
+                throw system_error(errno, system_category(), "Start, failed to set up " + staging);
+            }
+            CollectStaleStaging();
+        }
+        int result_pipe[2];
+        CreatePipe(result_pipe);
+        result_fd = result_pipe[1];
+        result_read_fd = result_pipe[0];
+        if (options.async_cleanup)
+        {
+            null_fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+            if (null_fd < 0)
+            {
+                throw system_error(errno, system_category(), "Start, open() failed");
+            }
+            // From now on the reaper is responsible for cleaning up
+            runner_pid = ForkCall([&]() { reap(args); });
+            owner_pid = runner_pid;
+        }
+        else
+        {
+            int ready_pipe[2];
+            CreatePipe(ready_pipe);
+            ready_fd = ready_pipe[1];
+            runner_pid = ForkCall([&]() { unshare_mount(args); });
+            Close(ready_fd);
+            ready_fd = -1;
+            // Until chroot_run has set PR_SET_PDEATHSIG, Kill() would leave it
+            // running. Nothing is written, EOF means every copy is closed
+            char c;
+            ReadAll(ready_pipe[0], &c, 1);
+            Close(ready_pipe[0]);
+        }
+        Close(result_fd);
+        result_fd = -1;
+    }
+
+    /* Readable when the next result is available */
+    int ResultFd() const
+    {
+        return result_read_fd;
+    }
+
+    /* Returns false once there are no more results */
+    bool NextResult(ExecResult& result)
+    {
+        return ReadAll(result_read_fd, &result, sizeof(result));
+    }
+
+    /* Waits for the sandbox to finish, unless it cleans up in background */
+    void Finish()
+    {
+        Close(result_read_fd);
+        result_read_fd = -1;
+        if (!options.async_cleanup)
         {
-            try { // We don't want to throw any exceptions from a dtor
-                log << "\n[" << getpid() << "] ~Sandbox():\n";
-                log << " ctor_pid = " << ctor_pid << "\n";
-                if (options.mount_program)
+            WaitPid(runner_pid);
+        }
+    }
+
+    /* Kills everything running in the sandbox. Only the rootfs is left
+     * to clean up, which is done as usual */
+    void Kill()
+    {
+        if (options.async_cleanup)
+        {
+            throw logic_error("Kill, cannot kill a sandbox that cleans up in background");
+        }
+        // chroot_run, the init of the sandbox's PID namespace, dies with us
+        kill(runner_pid, SIGKILL);
+    }
+
+  private:
+    static vector<string> always_mount;
+    vector<string> system_folders;  // always_mount, or the folders in options.rootfs
+    static constexpr const char* temp_folder = "/tmp";
+    static constexpr const char* temp_prefix = "sandbox_";
+    static constexpr time_t stale_age_sec = 60;
+    Options options;
+    string rootfs;
+    pid_t owner_pid;    // The process that has to clean up rootfs
+    int lock_fd;
+    int result_fd;
+    int null_fd;
+    FILE* session_input;
+    int profile_fd;
+    SyscallProfile profile;
+    int proc_fd;        // The procfs of the sandbox's PID namespace, in chroot_run
+    int timeline_fd;
+    vector<TimelineSample> timeline;    // A ring buffer, allocated in chroot_run
+    size_t timeline_count;
+    unsigned long long start_ms;
+    static constexpr size_t timeline_capacity = 16384;
+    pid_t runner_pid;
+    int result_read_fd;
+    int ready_fd;       // Closed by chroot_run once it dies with unshare_mount
+    int stdin_fd;
+    int stdout_fd;
+    string program_mount_point;
+    string output_path;         // Inside the sandbox
+    string output_mount_point;
+    int output_fd;
+    int staging_fd;     // Where the program writes, in output_folder
+    string staging_name;
+    static constexpr const char* staging_prefix = ".sandbox_";
+    static constexpr unsigned int output_check_interval_ms = 100;
+    static constexpr const char* program_path = "/program";
+
+    bool InSession() const
+    {
+        return !options.session_file.empty();
+    }
+
+    /* Sessions share /tmp, programs that write output get one for scratch
+     * files that are not part of it */
+    bool HasTmp() const
+    {
+        return InSession() || !options.output_folder.empty();
+    }
+
+    /* Names at the top of rootfs that we use ourselves */
+    static bool IsReserved(const string& name)
+    {
+        return name == "mnt" || name == "tmp" || name == "proc" || name == "sys" ||
+               "/" + name == program_path;
+    }
+
+    void Cleanup()
+    {
+        try { // We don't want to throw any exceptions from a dtor
+            log << "\n[" << getpid() << "] Cleanup():\n";
+            log << " owner_pid = " << owner_pid << "\n";
+            if (options.mount_program)
+            {
+                log << " Deleting " << program_mount_point << "\n";
+                DeleteFile(program_mount_point);
+            }
+            for (auto& path : options.extra_mounts)
+            {
+                string mount_point = rootfs + "/mnt/" + BaseName(path);
+                log << " Deleting " << mount_point << "\n";
+                if (IsDirectory(mount_point))
                 {
-                    log << " Deleting " << program_mount_point << "\n";
-                    DeleteFile(program_mount_point);
+                    DeleteFolder(mount_point);
                 }
-                for (auto& path : options.extra_mounts)
+                if (IsRegularFile(mount_point))
+                {
+                    DeleteFile(mount_point);
+                }
+            }
+            if (!output_mount_point.empty() && IsDirectory(output_mount_point))
+            {
+                log << " Deleting " << output_mount_point << "\n";
+                DeleteFolder(output_mount_point);
+            }
+            if (staging_fd >= 0)
+            {
+                delete_staging();
+            }
+            log << " Deleting " << rootfs + "/mnt" << "\n";
+            DeleteFolder(rootfs + "/mnt");
+            if (HasTmp())
+            {
+                log << " Deleting " << rootfs + "/tmp" << "\n";
+                DeleteFolder(rootfs + "/tmp");
+            }
+            // chroot_run deletes these, unless it was killed
+            for (auto& folder : { "/proc", "/sys" })
+            {
+                if (PathExists(rootfs + folder))
+                {
+                    log << " Deleting " << rootfs + folder << "\n";
+                    DeleteFolder(rootfs + folder);
+                }
+            }
+            for (auto& folder : system_folders)
+            {
+                string mount_point = rootfs + folder;
+                if (PathExists(mount_point))
                 {
-                    string mount_point = rootfs + "/mnt/" + BaseName(path);
                     log << " Deleting " << mount_point << "\n";
-                    if (IsDirectory(mount_point))
-                    {
-                        DeleteFolder(mount_point);
-                    }
-                    if (IsRegularFile(mount_point))
-                    {
-                        DeleteFile(mount_point);
-                    }
+                    DeleteFolder(mount_point);
                 }
-                log << " Deleting " << rootfs + "/mnt" << "\n";
-                DeleteFolder(rootfs + "/mnt");
-                for (auto& folder : always_mount)
+            }
+            log << " Unmounting rootfs @ " << rootfs << "\n";
+            Unmount(rootfs);
+            log << " Deleting rootfs @ " << rootfs << "\n";
+            DeleteFolder(rootfs);
+            log << "Finished cleanup\n";
+        }
+        catch (const exception& e) {
+            log << "Cleanup - error cleaning up: " << e.what() << "\n";
+        }
+    }
+
+    /* Runs the sandbox in the background on behalf of RunCommand, and tears
+     * it down after the result has been reported */
+    void reap(char* args[])
+    {
+        try {
+            owner_pid = getpid();
+            log << "\n[" << getpid() << "] reap():\n";
+            pid_t pid = ForkCall([&]() { unshare_mount(args); });
+            // Our caller may be gone long before we are done
+            signal(SIGHUP, SIG_IGN);
+            signal(SIGINT, SIG_IGN);
+            Close(result_fd);
+            RedirectStdio(null_fd, options.debug);
+            WaitPid(pid);
+            Cleanup();
+            CollectStaleSandboxes();
+        }
+        catch (exception& e) {
+            log << "Exception in reap(): " << e.what() << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    /* Deletes rootfs folders left behind by sandboxes that did not get
+     * to clean up, e.g. because they were killed */
+    void CollectStaleSandboxes()
+    {
+        log << "\n[" << getpid() << "] CollectStaleSandboxes():\n";
+        for (auto& name : ListFolder(temp_folder))
+        {
+            string path = string(temp_folder) + "/" + name;
+            if (name.compare(0, strlen(temp_prefix), temp_prefix) != 0 || path == rootfs)
+            {
+                continue;
+            }
+            try {
+                // Skip young folders whose owner might not have locked them yet
+                if (!IsDirectory(path) || PathOwner(path) != 0 ||
+                    time(NULL) - PathModificationTime(path) < stale_age_sec)
                 {
-                    string mount_point = rootfs + folder;
-                    if (PathExists(mount_point))
-                    {
-                        log << " Deleting " << mount_point << "\n";
-                        DeleteFolder(mount_point);
-                    }
+                    continue;
                 }
-                log << " Unmounting rootfs @ " << rootfs << "\n";
-                Unmount(rootfs);
-                log << " Deleting rootfs @ " << rootfs << "\n";
-                DeleteFolder(rootfs);
-                log << "Finished cleanup\n";
+                int fd = LockPath(path);
+                if (fd < 0)
+                {
+                    continue;   // Still in use
+                }
+                log << " Deleting stale sandbox " << path << "\n";
+                TryUnmount(path);
+                DeleteFolderTree(path);
+                Close(fd);
             }
             catch (const exception& e) {
-                log << "~Sandbox - error cleaning up: " << e.what() << "\n";
+                log << " Could not delete " << path << ": " << e.what() << "\n";
             }
         }
     }
 
-    void RunCommand(char* args[])
+    /* Deletes the staging folders left in the output folder by sandboxes
+     * that were killed before they could move the output */
+    void CollectStaleStaging()
     {
-        ForkCallWait([&]() { unshare_mount(args); });
+        log << "\n[" << getpid() << "] CollectStaleStaging():\n";
+        for (auto& name : ListFolder(options.output_folder))
+        {
+            if (name.compare(0, strlen(staging_prefix), staging_prefix) != 0 || name == staging_name)
+            {
+                continue;
+            }
+            string path = options.output_folder + "/" + name;
+            try {
+                // Owned by the sandbox uid, so we open it as root, relative to output_fd
+                int fd = openat(output_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (fd < 0)
+                {
+                    throw system_error(errno, system_category(), "openat() failed");
+                }
+                struct stat s;
+                // Skip young folders whose owner might not have locked them yet
+                if (fstat(fd, &s) < 0 || time(NULL) - s.st_mtime < stale_age_sec ||
+                    flock(fd, LOCK_EX | LOCK_NB) < 0)
+                {
+                    Close(fd);
+                    continue;
+                }
+                log << " Deleting stale staging folder " << path << "\n";
+                DeleteFolderContents(fd);
+                if (unlinkat(output_fd, name.c_str(), AT_REMOVEDIR) < 0)
+                {
+                    throw system_error(errno, system_category(), "unlinkat() failed");
+                }
+                Close(fd);
+            }
+            catch (const exception& e) {
+                log << " Could not delete " << path << ": " << e.what() << "\n";
+            }
+        }
     }
 
-  private:
-    static vector<string> always_mount;
-    Options options;
-    string rootfs;
-    pid_t ctor_pid;
-    string program_mount_point;
-    static constexpr const char* program_path = "/program";
-
     void unshare_mount(char* args[])
     {
         try {
             log << "\n[" << getpid() << "] unshare_mount():\n";
+            if (stdin_fd >= 0 || stdout_fd >= 0)
+            {
+                if ((stdin_fd >= 0 && dup2(stdin_fd, STDIN_FILENO) < 0) ||
+                    (stdout_fd >= 0 && dup2(stdout_fd, STDOUT_FILENO) < 0))
+                {
+                    throw system_error(errno, system_category(), "unshare_mount, dup2() failed");
+                }
+                // Other ends of the pipes must not be held open in here
+                vector<int> keep { result_fd, lock_fd, null_fd, profile_fd, timeline_fd,
+                                   output_fd, staging_fd, ready_fd };
+                if (session_input)
+                {
+                    keep.push_back(fileno(session_input));
+                }
+                CloseAllFdsExcept(keep);
+            }
             int flags = CLONE_NEWNS | CLONE_NEWIPC | CLONE_NEWUTS |
                         CLONE_NEWNET | CLONE_NEWPID | CLONE_SYSVSEM;
             // TODO: Add CLONE_NEWCGROUP for Linux 4.6+
             Unshare(flags);
             MarkMountPointPrivate("/");
 
-            for (auto& folder : always_mount)
+            for (auto& folder : system_folders)
             {
-                if (PathExists(folder))
+                string source = options.rootfs + folder;
+                if (PathExists(source))
                 {
                     string mount_point = rootfs + folder;
-                    log << " Mounting folder " << folder << " at " << mount_point << "\n";
-                    BindMount(folder, mount_point);
+                    log << " Mounting folder " << source << " at " << mount_point << "\n";
+                    // -R folders may have been built by anyone, trust no set-user-ID bits
+                    BindMount(source, mount_point,
+                              options.rootfs.empty() ? MS_RDONLY : MS_RDONLY | MS_NOSUID);
                 }
             }
 
@@ -268,6 +961,26 @@ class Sandbox
                 }
             }
 
+            if (!output_mount_point.empty())
+            {
+                string staging = options.output_folder + "/" + staging_name;
+                log << " Mounting " << staging << " at " << output_mount_point << "\n";
+                BindMount(staging, output_mount_point, MS_NOSUID | MS_NODEV);
+                // The user could have replaced the path since we created it
+                struct stat created, mounted;
+                if (fstat(staging_fd, &created) < 0 || stat(output_mount_point.c_str(), &mounted) < 0 ||
+                    created.st_dev != mounted.st_dev || created.st_ino != mounted.st_ino)
+                {
+                    throw runtime_error("unshare_mount, " + staging + " was replaced");
+                }
+            }
+            if (HasTmp())
+            {
+                string mount_point = rootfs + "/tmp";
+                log << " Mounting tmpfs at " << mount_point << "\n";
+                MountTmpfs(mount_point, "mode=1777,size=" + to_string(options.tmp_size));
+            }
+
             if (options.mount_program)
             {
                 log << " Mounting program " << args[0] << " at " << program_mount_point << "\n";
@@ -275,14 +988,36 @@ class Sandbox
                 args[0] = strdup(program_path);
             }
 
-            ForkCallWait([&]() { chroot_run(args); });
+            pid_t pid = ForkCall([&]() { chroot_run(args); });
+            // chroot_run closes its copy after the last result
+            Close(result_fd);
+            if (ready_fd >= 0)
+            {
+                Close(ready_fd);
+            }
+            if (options.async_cleanup)
+            {
+                // Only the program needs our stdio, don't hold it while cleaning up
+                RedirectStdio(null_fd, options.debug);
+            }
+            WaitPid(pid);
 
             log << "\n Unmounting...\n";
+            if (HasTmp())
+            {
+                log << " Unmounting " << rootfs + "/tmp" << "\n";
+                Unmount(rootfs + "/tmp");
+            }
             if (options.mount_program)
             {
                 log << " Unmounting " << program_mount_point << "\n";
                 Unmount(program_mount_point);
             }
+            if (!output_mount_point.empty())
+            {
+                log << " Unmounting " << output_mount_point << "\n";
+                Unmount(output_mount_point);
+            }
 
             for (auto& path : options.extra_mounts)
             {
@@ -294,7 +1029,7 @@ class Sandbox
                 }
             }
 
-            for (auto& folder : always_mount)
+            for (auto& folder : system_folders)
             {
                 string mount_point = rootfs + folder;
                 if (PathExists(mount_point))
@@ -315,6 +1050,16 @@ class Sandbox
     {
         try {
             log << "\n[" << getpid() << "] chroot_run():\n";
+            start_ms = NowMs();
+            // Take the whole sandbox down if unshare_mount is killed
+            if (prctl(PR_SET_PDEATHSIG, SIGKILL) < 0)
+            {
+                throw system_error(errno, system_category(), "chroot_run, prctl() failed");
+            }
+            if (ready_fd >= 0)
+            {
+                Close(ready_fd);
+            }
             Chroot(rootfs);
             Chdir("/");
 
@@ -328,16 +1073,65 @@ class Sandbox
                 CreateFolder("/sys");
                 MountSpecialFileSystem("/sys", "sysfs");
             }
+            if (timeline_fd >= 0)
+            {
+                timeline.resize(timeline_capacity);
+            }
+            if (options.idle_ms > 0 || InSession() || timeline_fd >= 0)
+            {
+                // Needed to watch the program's processes, even without -p
+                proc_fd = options.mount_proc ? open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC)
+                                             : OpenPrivateProcfs("/proc");
+                if (proc_fd < 0)
+                {
+                    throw system_error(errno, system_category(), "chroot_run, open() failed");
+                }
+            }
 
-            if (options.timeout_ms > 0)
+            if (InSession())
             {
-                ForkExecWaitTimeout(args, [&]() { drop_privilege(); }, options.timeout_ms);
+                run_session();
+                // There is no result left to report an error with
+                harvest_output();
             }
             else
             {
-                ForkExecWait(args, [&]() { drop_privilege(); });
+                ExecResult result = execute(args, options);
+                // Nothing left running may touch the output while it is moved,
+                // which is complete once the result is reported
+                KillAllProcesses();
+                result.output_error = harvest_output();
+                WriteAll(result_fd, &result, sizeof(result));
+            }
+            if (staging_fd >= 0)
+            {
+                delete_staging();   // With what could not be moved
+            }
+            // With -a the caller goes on once result_fd is closed
+            if (profile_fd >= 0)
+            {
+                ostringstream oss;
+                WriteSyscallProfile(oss, profile);
+                WriteAll(profile_fd, oss.str().data(), oss.str().size());
+                Close(profile_fd);
+            }
+            if (timeline_fd >= 0)
+            {
+                ostringstream oss;
+                WriteTimeline(oss, timeline, timeline_count);
+                WriteAll(timeline_fd, oss.str().data(), oss.str().size());
+                Close(timeline_fd);
+            }
+            Close(result_fd);
+            if (options.async_cleanup)
+            {
+                RedirectStdio(null_fd, options.debug);
             }
 
+            if (proc_fd >= 0)
+            {
+                Close(proc_fd);
+            }
             if (options.mount_sys)
             {
                 Unmount("/sys");
@@ -356,6 +1150,189 @@ class Sandbox
         }
     }
 
+    ExecResult execute(char* args[], const Options& limits)
+    {
+        if (profile_fd >= 0)
+        {
+            return ForkExecTrace(args, [&]() { drop_privilege(); }, limits.timeout_ms, profile);
+        }
+        if (limits.idle_ms > 0 || timeline_fd >= 0 || output_fd >= 0)
+        {
+            unsigned int interval_ms = UINT_MAX;
+            if (limits.idle_ms > 0)
+            {
+                interval_ms = min(interval_ms, limits.idle_interval_ms);
+            }
+            if (timeline_fd >= 0)
+            {
+                interval_ms = min(interval_ms, limits.timeline_interval_ms);
+            }
+            if (output_fd >= 0)
+            {
+                interval_ms = min(interval_ms, output_check_interval_ms);
+            }
+            return ForkExecMonitor(args, [&]() { drop_privilege(); }, limits.timeout_ms,
+                                   interval_ms, monitor(limits));
+        }
+        if (limits.timeout_ms > 0)
+        {
+            return ForkExecWaitTimeout(args, [&]() { drop_privilege(); }, limits.timeout_ms);
+        }
+        return ForkExecWait(args, [&]() { drop_privilege(); });
+    }
+
+    /* Samples the program's processes for the timeline, and stops the
+     * program once they used less than idle_cpu_percent of a CPU during the
+     * last idle_ms, e.g. when it is blocked forever, or once the output
+     * folder holds more than output_size */
+    Monitor monitor(const Options& limits)
+    {
+        struct Sample
+        {
+            unsigned long long time_ms;
+            unsigned long long cpu_ms;
+        };
+        // The program has not used any CPU time yet
+        auto samples = make_shared<deque<Sample>>(1, Sample{ NowMs(), 0 });
+        auto next_output_check_ms = make_shared<unsigned long long>(0);
+        unsigned long long window_ms = limits.idle_ms;
+        unsigned long long cpu_percent = limits.idle_cpu_percent;
+        return [=](Verdict& verdict) {
+            unsigned long long now_ms = NowMs();
+            if (output_fd >= 0 && *next_output_check_ms <= now_ms)
+            {
+                // Walks the whole folder, not as often as the timeline is sampled
+                *next_output_check_ms = now_ms + output_check_interval_ms;
+                unsigned long long usage = FolderUsage(staging_fd);
+                if (usage > options.output_size)
+                {
+                    log << "\n[" << getpid() << "] Output limit: " << usage << " bytes\n";
+                    verdict = Verdict::OutputLimit;
+                    return false;
+                }
+            }
+            if (timeline_fd < 0 && window_ms == 0)
+            {
+                return true;
+            }
+            ProcessStats stats = SumProcessStats(proc_fd);
+            Sample now { now_ms, stats.cpu_ms };
+            if (timeline_fd >= 0)
+            {
+                timeline[timeline_count++ % timeline.size()] = { now.time_ms - start_ms, stats };
+            }
+            if (window_ms == 0)
+            {
+                return true;
+            }
+            samples->push_back(now);
+            // Keep the newest sample that is at least window_ms old
+            while (samples->size() > 1 && (*samples)[1].time_ms + window_ms <= now.time_ms)
+            {
+                samples->pop_front();
+            }
+            const Sample& then = samples->front();
+            if (then.time_ms + window_ms <= now.time_ms &&
+                (now.cpu_ms - then.cpu_ms) * 100 < cpu_percent * window_ms)
+            {
+                log << "\n[" << getpid() << "] Idle: " << now.cpu_ms - then.cpu_ms
+                    << " ms of CPU time in the last " << now.time_ms - then.time_ms << " ms\n";
+                verdict = Verdict::Idle;
+                return false;
+            }
+            return true;
+        };
+    }
+
+    /* Moves the files written to the output folder to options.output_folder,
+     * unless they take more than output_size. Nothing of the program may be
+     * running anymore. Returns 0, or the errno of what was not moved, which
+     * is left in the staging folder */
+    int harvest_output()
+    {
+        if (output_fd < 0)
+        {
+            return 0;
+        }
+        log << "\n[" << getpid() << "] Moving " << output_path << " to "
+            << options.output_folder << "\n";
+        int error = 0;
+        try {
+            // Written between two checks of the monitor, or under -P
+            unsigned long long usage = FolderUsage(staging_fd);
+            error = (usage > options.output_size) ? EDQUOT
+                                                  : MoveFolderAsRealUser(staging_fd, output_fd);
+        }
+        catch (system_error& e) {
+            log << " " << e.what() << "\n";
+            error = e.code().value();
+        }
+        if (error != 0)
+        {
+            cerr << "Error: could not move the output to " << options.output_folder << ": "
+                 << strerror(error) << "\n";
+        }
+        return error;
+    }
+
+    /* Deletes the output folder's staging folder if harvest_output() did not
+     * get to move it, e.g. because the sandbox was killed */
+    void delete_staging()
+    {
+        struct stat staging, found;
+        if (fstat(staging_fd, &staging) < 0 || staging.st_nlink == 0 ||
+            fstatat(output_fd, staging_name.c_str(), &found, AT_SYMLINK_NOFOLLOW) < 0 ||
+            found.st_dev != staging.st_dev || found.st_ino != staging.st_ino)
+        {
+            return;     // Already gone
+        }
+        log << " Deleting " << options.output_folder + "/" + staging_name << "\n";
+        DeleteFolderContents(staging_fd);
+        if (unlinkat(output_fd, staging_name.c_str(), AT_REMOVEDIR) < 0)
+        {
+            throw system_error(errno, system_category(), "delete_staging, unlinkat() failed");
+        }
+    }
+
+    /* Runs the session's commands one by one, we are the init process of
+     * the sandbox's PID namespace */
+    void run_session()
+    {
+        Chdir("/tmp");
+        char* line = nullptr;
+        size_t size = 0;
+        while (getline(&line, &size, session_input) >= 0)
+        {
+            string command_line = line;
+            if (command_line.find_first_not_of(" \t\n") == string::npos)
+            {
+                continue;
+            }
+            log << "\n[" << getpid() << "] Session command: " << command_line;
+            ExecResult result;
+            try {
+                Options limits = options;
+                vector<string> command = limits.ParseSessionCommand(command_line);
+                vector<char*> args;
+                for (auto& arg : command)
+                {
+                    args.push_back(&arg[0]);
+                }
+                args.push_back(nullptr);
+                result = execute(args.data(), limits);
+            }
+            catch (runtime_error& e) {
+                log << e.what() << "\n";
+                result = ExecResult();
+                result.verdict = Verdict::Invalid;
+            }
+            // Do not let anything started by this command outlive it
+            KillAllProcesses();
+            WriteAll(result_fd, &result, sizeof(result));
+        }
+        free(line);
+    }
+
     void drop_privilege(void)
     {
         try
@@ -375,16 +1352,264 @@ class Sandbox
                 throw system_error(errno, system_category(),
                                    "drop_privilege, setuid() failed");
             }
+            if (output_fd >= 0)
+            {
+                // A single file cannot outgrow the output folder between two checks
+                struct rlimit limit { options.output_size, options.output_size };
+                if (setrlimit(RLIMIT_FSIZE, &limit) < 0)
+                {
+                    throw system_error(errno, system_category(),
+                                       "drop_privilege, setrlimit() failed");
+                }
+            }
+            if (profile_fd >= 0)
+            {
+                InstallSyscallTraceFilter();
+            }
         }
         catch(exception& e)
         {
             log << "Error: " << e.what() << "\n";
-            exit(EXIT_FAILURE);
+            // Not exit(), which would rewind the session input we share
+            _exit(EXIT_FAILURE);
         }
     }
 };
 
 vector<string> Sandbox::always_mount{ "/bin", "/etc", "/lib", "/lib32", "/lib64", "/usr" };
+constexpr unsigned int Sandbox::output_check_interval_ms;   // Passed to min() by reference
+
+enum class RelayState { Moved, Blocked, Closed };
+
+/* Moves what is available from in_fd to out_fd without blocking. Blocked
+ * means out_fd is full, retry once it is writable */
+RelayState Relay(int in_fd, int out_fd)
+{
+    ssize_t n = splice(in_fd, NULL, out_fd, NULL, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0)
+    {
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            return RelayState::Blocked;
+        }
+        if (errno == EPIPE)
+        {
+            return RelayState::Closed;
+        }
+        throw system_error(errno, system_category(), "Relay, splice() failed");
+    }
+    return n > 0 ? RelayState::Moved : RelayState::Closed;
+}
+
+/* Runs -i mode: the program and the interactor in two sandboxes talking
+ * over pipes, directly or through us with -L. Returns the exit code */
+int RunInteractive(const Options& program_options, char* program_args[],
+                   const Options& interactor_options, char* interactor_args[], int report_fd)
+{
+    Sandbox program {program_options};
+    Sandbox interactor {interactor_options};
+    bool relay = program_options.measure_latency;
+    int to_program[2], to_interactor[2];
+    int from_program[2] = { -1, -1 };
+    int from_interactor[2] = { -1, -1 };
+    CreatePipe(to_program);
+    CreatePipe(to_interactor);
+    if (relay)
+    {
+        CreatePipe(from_program);
+        CreatePipe(from_interactor);
+        program.SetStdio(to_program[0], from_program[1]);
+        interactor.SetStdio(to_interactor[0], from_interactor[1]);
+    }
+    else
+    {
+        program.SetStdio(to_program[0], to_interactor[1]);
+        interactor.SetStdio(to_interactor[0], to_program[1]);
+    }
+    program.Start(program_args);
+    interactor.Start(interactor_args);
+    Close(to_program[0]);
+    Close(to_interactor[0]);
+    if (relay)
+    {
+        Close(from_program[1]);
+        Close(from_interactor[1]);
+        // A closed reader shows up as EPIPE from Relay()
+        signal(SIGPIPE, SIG_IGN);
+    }
+    else
+    {
+        Close(to_program[1]);
+        Close(to_interactor[1]);
+    }
+
+    struct Side
+    {
+        Sandbox* sandbox;
+        ExecResult result;
+        bool reported;
+        bool finished;
+        bool killed;
+    };
+    Side sides[2] = {
+        { &program, ExecResult(), false, false, false },
+        { &interactor, ExecResult(), false, false, false }
+    };
+    // Round trips: from a message of the program to the interactor's reply
+    unsigned long round_trips = 0;
+    unsigned long long total_ns = 0, max_ns = 0;
+    bool program_waiting = false;
+    struct timespec sent;
+    // Set while a reader does not keep up, we wait until we can write to it
+    bool to_interactor_full = false, to_program_full = false;
+    while (!sides[0].finished || !sides[1].finished)
+    {
+        vector<struct pollfd> fds;
+        for (auto& side : sides)
+        {
+            fds.push_back({ side.finished ? -1 : side.sandbox->ResultFd(), POLLIN, 0 });
+        }
+        fds.push_back(to_interactor_full ? pollfd{ to_interactor[1], POLLOUT, 0 }
+                                         : pollfd{ from_program[0], POLLIN, 0 });
+        fds.push_back(to_program_full ? pollfd{ to_program[1], POLLOUT, 0 }
+                                      : pollfd{ from_interactor[0], POLLIN, 0 });
+        if (poll(fds.data(), fds.size(), -1) < 0)
+        {
+            if (errno == EINTR) continue;
+            throw system_error(errno, system_category(), "RunInteractive, poll() failed");
+        }
+        for (int i = 0; i < 2; i++)
+        {
+            if (fds[i].revents == 0)
+            {
+                continue;
+            }
+            Side& side = sides[i];
+            Side& other = sides[1 - i];
+            if (!side.sandbox->NextResult(side.result))
+            {
+                side.finished = true;
+                continue;
+            }
+            side.reported = true;
+            if (side.result.verdict != Verdict::Exited && !other.reported && !other.killed)
+            {
+                log << "\n[" << getpid() << "] Killing the other sandbox\n";
+                other.sandbox->Kill();
+                other.killed = true;
+            }
+        }
+        if (fds[2].revents != 0)
+        {
+            RelayState state = Relay(from_program[0], to_interactor[1]);
+            to_interactor_full = (state == RelayState::Blocked);
+            if (state == RelayState::Moved)
+            {
+                if (!program_waiting)
+                {
+                    program_waiting = true;
+                    clock_gettime(CLOCK_MONOTONIC, &sent);
+                }
+            }
+            else if (state == RelayState::Closed)
+            {
+                Close(from_program[0]);
+                Close(to_interactor[1]);
+                from_program[0] = -1;
+                to_interactor[1] = -1;
+            }
+        }
+        if (fds[3].revents != 0)
+        {
+            RelayState state = Relay(from_interactor[0], to_program[1]);
+            to_program_full = (state == RelayState::Blocked);
+            if (state == RelayState::Moved)
+            {
+                if (program_waiting)
+                {
+                    struct timespec now;
+                    clock_gettime(CLOCK_MONOTONIC, &now);
+                    unsigned long long ns = (now.tv_sec - sent.tv_sec) * 1000000000ULL +
+                                            now.tv_nsec - sent.tv_nsec;
+                    round_trips++;
+                    total_ns += ns;
+                    max_ns = max(max_ns, ns);
+                    program_waiting = false;
+                }
+            }
+            else if (state == RelayState::Closed)
+            {
+                Close(from_interactor[0]);
+                Close(to_program[1]);
+                from_interactor[0] = -1;
+                to_program[1] = -1;
+            }
+        }
+    }
+    for (auto fd : { from_program[0], from_interactor[0], to_program[1], to_interactor[1] })
+    {
+        if (relay && fd >= 0)
+        {
+            close(fd);
+        }
+    }
+    program.Finish();
+    interactor.Finish();
+
+    for (auto& side : sides)
+    {
+        if (!side.reported)
+        {
+            side.result = ExecResult();
+            side.result.status = SIGKILL;   // As wait() reports it
+            side.result.verdict = Verdict::Killed;
+        }
+    }
+    if (report_fd >= 0)
+    {
+        ostringstream oss;
+        oss << "[program]\n";
+        WriteResult(oss, sides[0].result, !program_options.output_folder.empty());
+        oss << "\n[interactor]\n";
+        WriteResult(oss, sides[1].result, !interactor_options.output_folder.empty());
+        if (relay)
+        {
+            oss << "\nround_trips: " << round_trips << "\n";
+            oss << "round_trip_avg_us: " << (round_trips ? total_ns / round_trips / 1000 : 0) << "\n";
+            oss << "round_trip_max_us: " << max_ns / 1000 << "\n";
+        }
+        WriteAll(report_fd, oss.str().data(), oss.str().size());
+    }
+    return ExitCode(sides[0].result);
+}
+
+/* Builds a rootfs for -R, with the permissions of the user running us */
+int RunBuildRootfs(const Options& options, const char* program)
+{
+    try {
+        if (setgid(getgid()) < 0 || setuid(getuid()) < 0)
+        {
+            throw system_error(errno, system_category(), "RunBuildRootfs, failed to drop privileges");
+        }
+        vector<string> files = SharedLibraryClosure(program);
+        for (auto& path : options.extra_files)
+        {
+            // Extra programs need their libraries too
+            vector<string> closure = SharedLibraryClosure(path);
+            files.insert(files.end(), closure.begin(), closure.end());
+        }
+        for (auto& path : files)
+        {
+            log << " " << path << "\n";
+        }
+        cout << BuildRootfs(options.build_rootfs, files) << "\n";
+    }
+    catch (exception& e) {
+        cerr << "Error: " << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
 int main(int argc, char* argv[])
 {
@@ -394,13 +1619,83 @@ int main(int argc, char* argv[])
     {
         log.SetOutput(&cerr);
     }
-    if (argc < 1)
+    if (!options.build_rootfs.empty())
+    {
+        if (argc != 1)
+        {
+            cerr << "Error: -B needs exactly one program!\n\n";
+            Options::Usage(prog);
+            exit(EXIT_FAILURE);
+        }
+        return RunBuildRootfs(options, argv[0]);
+    }
+    Options interactor_options;
+    vector<char*> program_args;
+    char** interactor_args = nullptr;
+    if (options.interactive)
+    {
+        int i = 0;
+        while (i < argc && strcmp(argv[i], "--") != 0)
+        {
+            program_args.push_back(argv[i++]);
+        }
+        program_args.push_back(nullptr);
+        if (i == 0 || i == argc)
+        {
+            cerr << "Error: -i needs a command and an interactor separated by --!\n\n";
+            Options::Usage(prog);
+            exit(EXIT_FAILURE);
+        }
+        Options defaults;
+        defaults.debug = options.debug;
+        defaults.uid = options.uid;
+        defaults.gid = options.gid;
+        int interactor_argc = argc - i;
+        interactor_args = argv + i;     // "--" takes the place of argv[0]
+        interactor_options = Options::Parse(interactor_argc, interactor_args, defaults);
+        for (auto& o : { options, interactor_options })
+        {
+            if (o.async_cleanup || !o.session_file.empty())
+            {
+                cerr << "Error: -a and -S cannot be used in interactive mode!\n\n";
+                Options::Usage(prog);
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (interactor_argc < 1)
+        {
+            cerr << "Error: missing interactor to execute!\n\n";
+            Options::Usage(prog);
+            exit(EXIT_FAILURE);
+        }
+    }
+    else if (!options.session_file.empty())
+    {
+        if (argc > 0)
+        {
+            cerr << "Error: a command cannot be specified in session mode!\n\n";
+            Options::Usage(prog);
+            exit(EXIT_FAILURE);
+        }
+        options.mount_program = false;
+    }
+    else if (argc < 1)
     {
         cerr << "Error: missing command to execute!\n\n";
         Options::Usage(prog);
         exit(EXIT_FAILURE);
     }
-    if (options.uid == 0 || options.gid == 0)
+    for (auto& o : { options, interactor_options })
+    {
+        if ((o.idle_ms > 0 || !o.timeline_file.empty()) && !o.profile_file.empty())
+        {
+            cerr << "Error: -I and -T cannot be used with -P!\n\n";
+            Options::Usage(prog);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.uid == 0 || options.gid == 0 ||
+        (options.interactive && (interactor_options.uid == 0 || interactor_options.gid == 0)))
     {
         cerr << "Error: could not determine a non-root uid/gid to drop privileges.\n\n";
         cerr << "You should either:\n";
@@ -410,7 +1705,55 @@ int main(int argc, char* argv[])
         exit(EXIT_FAILURE);
     }
     options.Log();
+    int result_fd = -1;
+    if (!options.result_file.empty())
+    {
+        try {
+            result_fd = OpenAsRealUser(options.result_file, O_WRONLY | O_CREAT | O_TRUNC);
+        }
+        catch (exception& e) {
+            cerr << "Error: could not open result file: " << e.what() << "\n";
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.interactive)
+    {
+        interactor_options.Log();
+        try {
+            return RunInteractive(options, program_args.data(), interactor_options,
+                                  interactor_args, result_fd);
+        }
+        catch (exception& e) {
+            cerr << "Error: " << e.what() << "\n";
+            return EXIT_FAILURE;
+        }
+    }
     Sandbox s {options};
-    s.RunCommand(argv);
-    return 0;
+    int exit_code = EXIT_SUCCESS;
+    try {
+        s.RunCommand(options.session_file.empty() ? argv : nullptr, [&](const ExecResult& result) {
+            log << "\n[" << getpid() << "] Result:\n";
+            log << " status = " << result.status << "\n";
+            if (result_fd >= 0)
+            {
+                ostringstream oss;
+                // In session mode the output is moved after the last result
+                WriteResult(oss, result, !options.output_folder.empty() && options.session_file.empty());
+                if (!options.session_file.empty())
+                {
+                    oss << "\n";
+                }
+                WriteAll(result_fd, oss.str().data(), oss.str().size());
+            }
+            if (options.session_file.empty())
+            {
+                exit_code = ExitCode(result);
+            }
+        });
+    }
+    catch (exception& e) {
+        cerr << "Error: " << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    return exit_code;
 }
@@ -0,0 +1,364 @@
+// C headers
+extern "C" {
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <elf.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+}
+// C++ headers
+#include <algorithm>
+#include <deque>
+#include <set>
+#include <stdexcept>
+#include <system_error>
+#include "util.h"
+#include "rootfs.h"
+
+using namespace std;
+using namespace util;
+
+/* Where the dynamic linker looks for libraries without the help of
+ * /etc/ld.so.cache, which is not part of the rootfs */
+static const vector<string> library_folders = {
+    "/lib/x86_64-linux-gnu", "/usr/lib/x86_64-linux-gnu",
+    "/lib/aarch64-linux-gnu", "/usr/lib/aarch64-linux-gnu",
+    "/lib/i386-linux-gnu", "/usr/lib/i386-linux-gnu",
+    "/lib64", "/usr/lib64", "/lib", "/usr/lib"
+};
+
+class MappedFile
+{
+  public:
+    explicit MappedFile(string path) : data{nullptr}, size{0}
+    {
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw system_error(errno, system_category(), "MappedFile, open() failed for " + path);
+        }
+        struct stat s;
+        if (fstat(fd, &s) < 0)
+        {
+            int e = errno;
+            close(fd);
+            throw system_error(e, system_category(), "MappedFile, fstat() failed");
+        }
+        size = s.st_size;
+        if (size > 0)
+        {
+            void* p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED)
+            {
+                int e = errno;
+                close(fd);
+                throw system_error(e, system_category(), "MappedFile, mmap() failed");
+            }
+            data = static_cast<const char*>(p);
+        }
+        close(fd);
+    }
+
+    ~MappedFile()
+    {
+        if (data)
+        {
+            munmap(const_cast<char*>(data), size);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data;
+    size_t size;
+};
+
+struct ElfInfo
+{
+    unsigned char elf_class;
+    uint16_t machine;
+    string interpreter;
+    vector<string> needed;
+    vector<string> search_path;     // DT_RUNPATH, or DT_RPATH if there is none
+};
+
+static bool IsElf(const MappedFile& file)
+{
+    return file.size >= EI_NIDENT && memcmp(file.data, ELFMAG, SELFMAG) == 0;
+}
+
+template<typename Ehdr, typename Phdr, typename Dyn>
+static ElfInfo ParseElf(const MappedFile& file)
+{
+    auto check = [&](uint64_t offset, uint64_t size) {
+        if (offset > file.size || size > file.size - offset)
+        {
+            throw runtime_error("ParseElf, truncated or corrupt ELF file");
+        }
+    };
+    check(0, sizeof(Ehdr));
+    auto ehdr = reinterpret_cast<const Ehdr*>(file.data);
+    ElfInfo info;
+    info.elf_class = ehdr->e_ident[EI_CLASS];
+    info.machine = ehdr->e_machine;
+
+    check(ehdr->e_phoff, uint64_t(ehdr->e_phnum) * sizeof(Phdr));
+    auto phdrs = reinterpret_cast<const Phdr*>(file.data + ehdr->e_phoff);
+    const Phdr* dynamic = nullptr;
+    for (size_t i = 0; i < ehdr->e_phnum; i++)
+    {
+        if (phdrs[i].p_type == PT_INTERP)
+        {
+            check(phdrs[i].p_offset, phdrs[i].p_filesz);
+            const char* s = file.data + phdrs[i].p_offset;
+            info.interpreter = string(s, strnlen(s, phdrs[i].p_filesz));
+        }
+        if (phdrs[i].p_type == PT_DYNAMIC)
+        {
+            dynamic = &phdrs[i];
+        }
+    }
+    if (dynamic == nullptr)
+    {
+        return info;    // Statically linked
+    }
+
+    // The dynamic section refers to the string table by its virtual address
+    auto file_offset = [&](uint64_t address) -> uint64_t {
+        for (size_t i = 0; i < ehdr->e_phnum; i++)
+        {
+            if (phdrs[i].p_type == PT_LOAD && address >= phdrs[i].p_vaddr &&
+                address < phdrs[i].p_vaddr + phdrs[i].p_filesz)
+            {
+                return phdrs[i].p_offset + (address - phdrs[i].p_vaddr);
+            }
+        }
+        throw runtime_error("ParseElf, address is not in any loaded segment");
+    };
+    check(dynamic->p_offset, dynamic->p_filesz);
+    auto dyn = reinterpret_cast<const Dyn*>(file.data + dynamic->p_offset);
+    size_t count = dynamic->p_filesz / sizeof(Dyn);
+    uint64_t strtab = 0;
+    for (size_t i = 0; i < count && dyn[i].d_tag != DT_NULL; i++)
+    {
+        if (dyn[i].d_tag == DT_STRTAB)
+        {
+            strtab = file_offset(dyn[i].d_un.d_ptr);
+        }
+    }
+    auto str = [&](uint64_t offset) {
+        check(strtab + offset, 1);
+        const char* s = file.data + strtab + offset;
+        return string(s, strnlen(s, file.size - strtab - offset));
+    };
+    string runpath, rpath;
+    for (size_t i = 0; i < count && dyn[i].d_tag != DT_NULL; i++)
+    {
+        switch (dyn[i].d_tag)
+        {
+            case DT_NEEDED:     info.needed.push_back(str(dyn[i].d_un.d_val));  break;
+            case DT_RUNPATH:    runpath = str(dyn[i].d_un.d_val);               break;
+            case DT_RPATH:      rpath = str(dyn[i].d_un.d_val);                 break;
+        }
+    }
+    string path = runpath.empty() ? rpath : runpath;
+    size_t start = 0;
+    while (start < path.size())
+    {
+        size_t end = path.find(':', start);
+        if (end == string::npos)
+        {
+            end = path.size();
+        }
+        if (end > start)
+        {
+            info.search_path.push_back(path.substr(start, end - start));
+        }
+        start = end + 1;
+    }
+    return info;
+}
+
+static ElfInfo ParseElf(const MappedFile& file)
+{
+    if (file.data[EI_CLASS] == ELFCLASS64)
+    {
+        return ParseElf<Elf64_Ehdr, Elf64_Phdr, Elf64_Dyn>(file);
+    }
+    return ParseElf<Elf32_Ehdr, Elf32_Phdr, Elf32_Dyn>(file);
+}
+
+static string ExpandOrigin(string folder, const string& origin)
+{
+    for (const char* token : { "${ORIGIN}", "$ORIGIN" })
+    {
+        size_t pos;
+        while ((pos = folder.find(token)) != string::npos)
+        {
+            folder.replace(pos, strlen(token), origin);
+        }
+    }
+    return folder;
+}
+
+/* Looks for a library the way the dynamic linker would, skipping the ones
+ * built for another architecture */
+static string FindLibrary(const string& name, const ElfInfo& user, const string& user_path)
+{
+    if (name.find('/') != string::npos)
+    {
+        return name;
+    }
+    string origin = user_path.substr(0, user_path.rfind('/'));
+    vector<string> folders;
+    for (auto& folder : user.search_path)
+    {
+        folders.push_back(ExpandOrigin(folder, origin));
+    }
+    folders.insert(folders.end(), library_folders.begin(), library_folders.end());
+    for (auto& folder : folders)
+    {
+        string candidate = folder + "/" + name;
+        if (!PathExists(candidate))
+        {
+            continue;
+        }
+        try {
+            MappedFile file(candidate);
+            if (IsElf(file))
+            {
+                ElfInfo info = ParseElf(file);
+                if (info.elf_class == user.elf_class && info.machine == user.machine)
+                {
+                    return candidate;
+                }
+            }
+        }
+        catch (const exception&) {
+            // Not a usable candidate, e.g. a dangling symbolic link
+        }
+    }
+    throw runtime_error("SharedLibraryClosure, could not find " + name + " needed by " + user_path);
+}
+
+vector<string> util::SharedLibraryClosure(string program)
+{
+    vector<string> closure;
+    set<string> seen;
+    deque<string> pending { AbsolutePath(program) };
+    while (!pending.empty())
+    {
+        string path = pending.front();
+        pending.pop_front();
+        if (!seen.insert(path).second)
+        {
+            continue;
+        }
+        closure.push_back(path);
+        MappedFile file(path);
+        if (file.size > 2 && file.data[0] == '#' && file.data[1] == '!')
+        {
+            string line(file.data + 2, find(file.data + 2, file.data + file.size, '\n'));
+            size_t start = line.find_first_not_of(" \t");
+            if (start != string::npos)
+            {
+                pending.push_back(line.substr(start, line.find_first_of(" \t\r", start) - start));
+            }
+            continue;
+        }
+        if (!IsElf(file))
+        {
+            continue;
+        }
+        ElfInfo info = ParseElf(file);
+        if (!info.interpreter.empty())
+        {
+            pending.push_back(info.interpreter);
+        }
+        for (auto& name : info.needed)
+        {
+            pending.push_back(FindLibrary(name, info, path));
+        }
+    }
+    return closure;
+}
+
+static uint64_t Fnv1a(uint64_t hash, const char* data, size_t size)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+string util::BuildRootfs(string cache_folder, vector<string> files)
+{
+    sort(files.begin(), files.end());
+    files.erase(unique(files.begin(), files.end()), files.end());
+    uint64_t hash = 14695981039346656037ULL;
+    for (auto& path : files)
+    {
+        if (path.empty() || path[0] != '/')
+        {
+            throw runtime_error("BuildRootfs, path is not absolute: " + path);
+        }
+        MappedFile file(path);
+        hash = Fnv1a(hash, path.c_str(), path.size() + 1);
+        hash = Fnv1a(hash, file.data, file.size);
+    }
+    // Like mkdir -p
+    size_t pos = 0;
+    do {
+        pos = cache_folder.find('/', pos + 1);
+        string prefix = cache_folder.substr(0, pos);
+        if (!IsDirectory(prefix))
+        {
+            CreateFolder(prefix);
+        }
+    } while (pos != string::npos);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    string folder = cache_folder + "/" + name;
+    if (IsDirectory(folder))
+    {
+        return folder;
+    }
+
+    // Build next to the final folder so that it appears there atomically
+    string temp = CreateTempFolder(cache_folder + "/.build_");
+    try {
+        ChangeMode(temp, 0755);
+        for (auto& path : files)
+        {
+            for (size_t pos = path.find('/', 1); pos != string::npos; pos = path.find('/', pos + 1))
+            {
+                string parent = temp + path.substr(0, pos);
+                if (!IsDirectory(parent))
+                {
+                    CreateFolder(parent);
+                }
+            }
+            CopyFile(path, temp + path);
+        }
+        if (rename(temp.c_str(), folder.c_str()) < 0)
+        {
+            if (errno != ENOTEMPTY && errno != EEXIST)
+            {
+                throw system_error(errno, system_category(), "BuildRootfs, rename() failed");
+            }
+            DeleteFolderTree(temp);     // Someone else built it meanwhile
+        }
+    }
+    catch (...) {
+        try { DeleteFolderTree(temp); } catch (...) { }
+        throw;
+    }
+    return folder;
+}
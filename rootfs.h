@@ -0,0 +1,20 @@
+#ifndef _ROOTFS_D9E2673EFADA464D9659570557AD587E
+#define _ROOTFS_D9E2673EFADA464D9659570557AD587E
+
+#include <string>
+#include <vector>
+
+namespace util
+{
+    /* Returns the absolute paths of the program, its interpreter (the ELF
+     * interpreter, or the one named after #! for scripts) and all shared
+     * libraries it needs directly or indirectly */
+    std::vector<std::string> SharedLibraryClosure(std::string program);
+
+    /* Copies files under a folder in cache_folder named after the hash of
+     * their paths and contents, each at its absolute path. Returns that
+     * folder, which is reused as is if it already exists */
+    std::string BuildRootfs(std::string cache_folder, std::vector<std::string> files);
+}
+
+#endif
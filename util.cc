@@ -9,11 +9,29 @@ extern "C" {
 #include <sys/types.h>
 #include <sys/mount.h>
 #include <sys/wait.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/ptrace.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <linux/fs.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include <stddef.h>
+#include <time.h>
 #include <signal.h>
 #include <libgen.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ctype.h>
+#include <ftw.h>
 }
 // C++ headers
 #include <iostream>
+#include <algorithm>
+#include <map>
 #include <system_error>
 #include "util.h"
 
@@ -73,6 +91,22 @@ string util::BaseName(string path)
     return bn;
 }
 
+string util::AbsolutePath(string path)
+{
+    if (!path.empty() && path[0] == '/')
+    {
+        return path;
+    }
+    char* cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+    {
+        throw system_error(errno, system_category(), "AbsolutePath, getcwd() failed");
+    }
+    string ap = string(cwd) + "/" + path;
+    free(cwd);
+    return ap;
+}
+
 void util::DeleteFile(string path)
 {
     if (unlink(path.c_str()) < 0)
@@ -100,6 +134,86 @@ void util::ChangeMode(string path, unsigned short mode)
     umask(old_mask);
 }
 
+uid_t util::PathOwner(string path)
+{
+    struct stat s;
+    if (lstat(path.c_str(), &s) < 0)
+    {
+        throw system_error(errno, system_category(), "PathOwner, lstat() failed");
+    }
+    return s.st_uid;
+}
+
+time_t util::PathModificationTime(string path)
+{
+    struct stat s;
+    if (lstat(path.c_str(), &s) < 0)
+    {
+        throw system_error(errno, system_category(), "PathModificationTime, lstat() failed");
+    }
+    return s.st_mtime;
+}
+
+vector<string> util::ListFolder(string path)
+{
+    DIR* dir = opendir(path.c_str());
+    if (dir == NULL)
+    {
+        throw system_error(errno, system_category(), "ListFolder, opendir() failed");
+    }
+    vector<string> names;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        string name = entry->d_name;
+        if (name != "." && name != "..")
+        {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+    return names;
+}
+
+static int DeleteTreeEntry(const char* path, const struct stat* s, int type, struct FTW* ftw)
+{
+    int r = (type == FTW_DP) ? rmdir(path) : unlink(path);
+    return (r < 0) ? errno : 0;
+}
+
+void util::DeleteFolderTree(string path)
+{
+    int r = nftw(path.c_str(), DeleteTreeEntry, 16, FTW_DEPTH | FTW_PHYS | FTW_MOUNT);
+    if (r < 0)
+    {
+        throw system_error(errno, system_category(), "DeleteFolderTree, nftw() failed");
+    }
+    if (r > 0)
+    {
+        throw system_error(r, system_category(), "DeleteFolderTree, failed to delete an entry");
+    }
+}
+
+int util::LockPath(string path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0)
+    {
+        throw system_error(errno, system_category(), "LockPath, open() failed");
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) < 0)
+    {
+        int e = errno;
+        close(fd);
+        if (e == EWOULDBLOCK)
+        {
+            return -1;
+        }
+        throw system_error(e, system_category(), "LockPath, flock() failed");
+    }
+    return fd;
+}
+
 string util::CreateTempFolder(string path_prefix)
 {
     char buffer[256];
@@ -127,13 +241,305 @@ void util::CreateFolder(string path, unsigned short mode)
     umask(old_mask);
 }
 
-void util::BindMount(string source, string dest)
+void util::CopyFile(string source, string dest)
+{
+    int in = open(source.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        throw system_error(errno, system_category(), "CopyFile, open() failed for " + source);
+    }
+    struct stat s;
+    if (fstat(in, &s) < 0)
+    {
+        int e = errno;
+        close(in);
+        throw system_error(e, system_category(), "CopyFile, fstat() failed");
+    }
+    int out = open(dest.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (out < 0)
+    {
+        int e = errno;
+        close(in);
+        throw system_error(e, system_category(), "CopyFile, open() failed for " + dest);
+    }
+    try {
+        CopyFileData(in, out);
+        // A set-user-ID copy would run as whoever made the copy
+        if (fchmod(out, s.st_mode & 0777) < 0)
+        {
+            throw system_error(errno, system_category(), "CopyFile, fchmod() failed");
+        }
+    }
+    catch (...) {
+        close(in);
+        close(out);
+        unlink(dest.c_str());
+        throw;
+    }
+    close(in);
+    close(out);
+}
+
+void util::CopyFileData(int in_fd, int out_fd)
+{
+    struct stat s;
+    if (fstat(in_fd, &s) < 0)
+    {
+        throw system_error(errno, system_category(), "CopyFileData, fstat() failed");
+    }
+    if (ioctl(out_fd, FICLONE, in_fd) == 0)
+    {
+        return;
+    }
+    // No reflinks here, copy_file_range() then sendfile() which works
+    // across all file systems. Both move the file offsets for us
+    bool use_sendfile = false;
+    off_t remaining = s.st_size;
+    while (remaining > 0)
+    {
+        ssize_t n = use_sendfile ? sendfile(out_fd, in_fd, NULL, remaining)
+                                 : copy_file_range(in_fd, NULL, out_fd, NULL, remaining, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            if (!use_sendfile && (errno == EXDEV || errno == EINVAL ||
+                                  errno == ENOSYS || errno == EOPNOTSUPP))
+            {
+                use_sendfile = true;
+                continue;
+            }
+            throw system_error(errno, system_category(), "CopyFileData, failed to copy");
+        }
+        if (n == 0)
+        {
+            break;  // The source shrank meanwhile
+        }
+        remaining -= n;
+    }
+}
+
+/* Closes a descriptor when it goes out of scope */
+struct ScopedFd
+{
+    explicit ScopedFd(int fd_) : fd{fd_} { }
+    ~ScopedFd() { if (fd >= 0) close(fd); }
+    ScopedFd(const ScopedFd&) = delete;
+    ScopedFd& operator=(const ScopedFd&) = delete;
+    int fd;
+};
+
+/* The names in the folder opened as folder_fd, except . and .. */
+static vector<string> ListFolderAt(int folder_fd)
+{
+    int dir_fd = dup(folder_fd);
+    DIR* dir = (dir_fd < 0) ? NULL : fdopendir(dir_fd);
+    if (dir == NULL)
+    {
+        if (dir_fd >= 0) close(dir_fd);
+        throw system_error(errno, system_category(), "ListFolderAt, fdopendir() failed");
+    }
+    rewinddir(dir);
+    vector<string> names;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        string name = entry->d_name;
+        if (name != "." && name != "..")
+        {
+            names.push_back(name);
+        }
+    }
+    closedir(dir);
+    return names;
+}
+
+/* Opens name in folder_fd, with the real user's permissions if as_real_user.
+ * Never follows a symbolic link or blocks on a FIFO */
+static int OpenAt(int folder_fd, const string& name, int flags, bool as_real_user)
+{
+    int fd = -1;
+    int e = 0;
+    auto task = [&]() {
+        fd = openat(folder_fd, name.c_str(), flags | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC, 0600);
+        e = errno;
+    };
+    if (as_real_user)
+    {
+        RunAsRealUser(task);
+    }
+    else
+    {
+        task();
+    }
+    if (fd < 0)
+    {
+        throw system_error(e, system_category(), "OpenAt, openat() failed for " + name);
+    }
+    return fd;
+}
+
+static void Unlink(int folder_fd, const string& name, bool is_folder)
+{
+    if (unlinkat(folder_fd, name.c_str(), is_folder ? AT_REMOVEDIR : 0) < 0)
+    {
+        throw system_error(errno, system_category(), "Unlink, unlinkat() failed for " + name);
+    }
+}
+
+void util::DeleteFolderContents(int folder_fd)
+{
+    for (auto& name : ListFolderAt(folder_fd))
+    {
+        struct stat s;
+        if (fstatat(folder_fd, name.c_str(), &s, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+            throw system_error(errno, system_category(), "DeleteFolderContents, fstatat() failed");
+        }
+        if (S_ISDIR(s.st_mode))
+        {
+            ScopedFd folder(OpenAt(folder_fd, name, O_RDONLY | O_DIRECTORY, false));
+            DeleteFolderContents(folder.fd);
+        }
+        Unlink(folder_fd, name, S_ISDIR(s.st_mode));
+    }
+}
+
+/* Gives the folders and regular files in folder_fd to the real user without
+ * set-user-ID bits, and deletes everything else */
+static void HandOverToRealUser(int folder_fd)
+{
+    for (auto& name : ListFolderAt(folder_fd))
+    {
+        struct stat s;
+        int fd = openat(folder_fd, name.c_str(), O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+        ScopedFd file(fd);
+        // The type is checked on what we opened, it cannot be swapped anymore
+        if (fd < 0 || fstat(fd, &s) < 0 || !(S_ISREG(s.st_mode) || S_ISDIR(s.st_mode)))
+        {
+            Unlink(folder_fd, name, false);     // A symbolic link or a special file
+            continue;
+        }
+        if (S_ISDIR(s.st_mode))
+        {
+            HandOverToRealUser(fd);
+        }
+        if (fchown(fd, getuid(), getgid()) < 0 || fchmod(fd, s.st_mode & 0777) < 0)
+        {
+            throw system_error(errno, system_category(), "HandOverToRealUser, failed for " + name);
+        }
+    }
+}
+
+/* Moves what is in source_fd to dest_fd, merging folders that exist in both.
+ * Returns the errno of the first entry that could not be moved, 0 if none */
+static int MoveEntries(int source_fd, int dest_fd)
+{
+    int first_error = 0;
+    for (auto& name : ListFolderAt(source_fd))
+    {
+        int e = 0;
+        RunAsRealUser([&]() {
+            if (renameat(source_fd, name.c_str(), dest_fd, name.c_str()) < 0)
+            {
+                e = errno;
+            }
+        });
+        if (e == 0)
+        {
+            continue;
+        }
+        try {
+            ScopedFd in(OpenAt(source_fd, name, O_RDONLY, false));
+            struct stat s;
+            if (fstat(in.fd, &s) < 0)
+            {
+                throw system_error(errno, system_category(), "MoveEntries, fstat() failed");
+            }
+            if (S_ISDIR(s.st_mode))
+            {
+                RunAsRealUser([&]() {
+                    mkdirat(dest_fd, name.c_str(), 0755);   // Exists already, most likely
+                });
+                ScopedFd out(OpenAt(dest_fd, name, O_RDONLY | O_DIRECTORY, true));
+                e = MoveEntries(in.fd, out.fd);
+            }
+            else
+            {
+                ScopedFd out(OpenAt(dest_fd, name, O_WRONLY | O_CREAT | O_TRUNC, true));
+                CopyFileData(in.fd, out.fd);
+                if (fchmod(out.fd, s.st_mode & 0777) < 0)
+                {
+                    throw system_error(errno, system_category(), "MoveEntries, fchmod() failed");
+                }
+                e = 0;
+            }
+            if (e == 0)
+            {
+                Unlink(source_fd, name, S_ISDIR(s.st_mode));
+            }
+        }
+        catch (system_error& err) {
+            // E.g. a folder where dest has a file of the same name, go on with the rest
+            e = err.code().value();
+        }
+        if (first_error == 0)
+        {
+            first_error = e;
+        }
+    }
+    return first_error;
+}
+
+int util::MoveFolderAsRealUser(int source_fd, int dest_fd)
+{
+    HandOverToRealUser(source_fd);
+    if (fchown(source_fd, getuid(), getgid()) < 0)
+    {
+        throw system_error(errno, system_category(), "MoveFolderAsRealUser, fchown() failed");
+    }
+    return MoveEntries(source_fd, dest_fd);
+}
+
+unsigned long long util::FolderUsage(int folder_fd)
+{
+    struct stat s;
+    if (fstat(folder_fd, &s) < 0)
+    {
+        throw system_error(errno, system_category(), "FolderUsage, fstat() failed");
+    }
+    unsigned long long bytes = s.st_blocks * 512ULL;
+    for (auto& name : ListFolderAt(folder_fd))
+    {
+        if (fstatat(folder_fd, name.c_str(), &s, AT_SYMLINK_NOFOLLOW) < 0)
+        {
+            if (errno == ENOENT) continue;
+            throw system_error(errno, system_category(), "FolderUsage, fstatat() failed");
+        }
+        if (!S_ISDIR(s.st_mode))
+        {
+            // Sparse files take their full size once copied
+            bytes += max<unsigned long long>(s.st_size, s.st_blocks * 512ULL);
+            continue;
+        }
+        int fd = openat(folder_fd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0)
+        {
+            if (errno == ENOENT || errno == ENOTDIR) continue;
+            throw system_error(errno, system_category(), "FolderUsage, openat() failed for " + name);
+        }
+        ScopedFd folder(fd);
+        bytes += FolderUsage(folder.fd);
+    }
+    return bytes;
+}
+
+void util::BindMount(string source, string dest, unsigned long flags)
 {
     if (mount(source.c_str(), dest.c_str(), "", MS_BIND | MS_REC, "") < 0)
     {
         throw system_error(errno, system_category(), "BindMount, 1st mount() failed");
     }
-    if (mount(source.c_str(), dest.c_str(), "", MS_BIND | MS_REMOUNT | MS_RDONLY | MS_PRIVATE, "") < 0)
+    if (mount(source.c_str(), dest.c_str(), "", MS_BIND | MS_REMOUNT | MS_PRIVATE | flags, "") < 0)
     {
         throw system_error(errno, system_category(), "BindMount, 2nd mount() failed");
     }
@@ -147,6 +553,19 @@ void util::Unmount(string dest)
     }
 }
 
+bool util::TryUnmount(string dest)
+{
+    if (umount2(dest.c_str(), MNT_DETACH) < 0)
+    {
+        if (errno == EINVAL)
+        {
+            return false;
+        }
+        throw system_error(errno, system_category(), "TryUnmount, umount() failed");
+    }
+    return true;
+}
+
 void util::MarkMountPointPrivate(string path)
 {
     if (mount(path.c_str(), path.c_str(), "", MS_REMOUNT | MS_PRIVATE, "") < 0)
@@ -172,6 +591,31 @@ void util::MountSpecialFileSystem(string path, string fs)
     }
 }
 
+void util::MountTmpfs(string path, string options)
+{
+    if (mount("tmpfs", path.c_str(), "tmpfs", MS_NOSUID | MS_NODEV, options.c_str()) < 0)
+    {
+        throw system_error(errno, system_category(), "MountTmpfs, mount() failed");
+    }
+}
+
+int util::OpenPrivateProcfs(string mount_point)
+{
+    CreateFolder(mount_point);
+    MountSpecialFileSystem(mount_point, "proc");
+    int fd = open(mount_point.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        throw system_error(errno, system_category(), "OpenPrivateProcfs, open() failed");
+    }
+    if (umount2(mount_point.c_str(), MNT_DETACH) < 0)
+    {
+        throw system_error(errno, system_category(), "OpenPrivateProcfs, umount2() failed");
+    }
+    DeleteFolder(mount_point);
+    return fd;
+}
+
 void util::Chroot(string new_root)
 {
     if (chroot(new_root.c_str()) < 0)
@@ -188,7 +632,124 @@ void util::Chdir(string path)
     }
 }
 
-void util::ForkExecWait(char* args[], Task beforeExec)
+void util::CreatePipe(int fds[2])
+{
+    if (pipe2(fds, O_CLOEXEC) < 0)
+    {
+        throw system_error(errno, system_category(), "CreatePipe, pipe2() failed");
+    }
+}
+
+void util::Close(int fd)
+{
+    if (close(fd) < 0)
+    {
+        throw system_error(errno, system_category(), "Close, close() failed");
+    }
+}
+
+void util::CloseAllFdsExcept(const vector<int>& keep)
+{
+    for (auto& name : ListFolder("/proc/self/fd"))
+    {
+        int fd = atoi(name.c_str());
+        if (fd > STDERR_FILENO && find(keep.begin(), keep.end(), fd) == keep.end())
+        {
+            close(fd);  // Fails for the descriptor ListFolder used, which is fine
+        }
+    }
+}
+
+void util::WriteAll(int fd, const void* buffer, size_t size)
+{
+    const char* p = static_cast<const char*>(buffer);
+    while (size > 0)
+    {
+        ssize_t n = write(fd, p, size);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            throw system_error(errno, system_category(), "WriteAll, write() failed");
+        }
+        p += n;
+        size -= n;
+    }
+}
+
+bool util::ReadAll(int fd, void* buffer, size_t size)
+{
+    char* p = static_cast<char*>(buffer);
+    while (size > 0)
+    {
+        ssize_t n = read(fd, p, size);
+        if (n < 0)
+        {
+            if (errno == EINTR) continue;
+            throw system_error(errno, system_category(), "ReadAll, read() failed");
+        }
+        if (n == 0)
+        {
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+void util::RedirectStdio(int fd, bool keep_stderr)
+{
+    if (dup2(fd, STDIN_FILENO) < 0 || dup2(fd, STDOUT_FILENO) < 0 ||
+        (!keep_stderr && dup2(fd, STDERR_FILENO) < 0))
+    {
+        throw system_error(errno, system_category(), "RedirectStdio, dup2() failed");
+    }
+}
+
+int util::OpenAsRealUser(string path, int flags)
+{
+    int fd = -1;
+    int e = 0;
+    RunAsRealUser([&]() {
+        fd = open(path.c_str(), flags | O_CLOEXEC, 0644);
+        e = errno;
+    });
+    if (fd < 0)
+    {
+        throw system_error(e, system_category(), "OpenAsRealUser, open() failed for " + path);
+    }
+    return fd;
+}
+
+void util::RunAsRealUser(function<void(void)> task)
+{
+    uid_t euid = geteuid();
+    gid_t egid = getegid();
+    if (setegid(getgid()) < 0)
+    {
+        throw system_error(errno, system_category(), "RunAsRealUser, setegid() failed");
+    }
+    if (seteuid(getuid()) < 0)
+    {
+        int e = errno;
+        setegid(egid);
+        throw system_error(e, system_category(), "RunAsRealUser, seteuid() failed");
+    }
+    try {
+        task();
+    }
+    catch (...) {
+        seteuid(euid);
+        setegid(egid);
+        throw;
+    }
+    if (seteuid(euid) < 0 || setegid(egid) < 0)
+    {
+        throw system_error(errno, system_category(), "RunAsRealUser, failed to restore privileges");
+    }
+}
+
+ExecResult util::ForkExecWait(char* args[], Task beforeExec)
 {
     pid_t pid = fork();
     if (pid == 0)
@@ -197,15 +758,18 @@ void util::ForkExecWait(char* args[], Task beforeExec)
         beforeExec();
         execv(args[0], args);
         cerr << "Error in execv: " << strerror(errno) << endl;
-        exit(EXIT_FAILURE);
+        _exit(EXIT_FAILURE);
     }
     else if (pid > 0)
     {
         // Parent
-        if (waitpid(pid, NULL, 0) < 0)
+        ExecResult result;
+        result.verdict = Verdict::Exited;
+        if (wait4(pid, &result.status, 0, &result.usage) < 0)
         {
-            throw system_error(errno, system_category(), "ForkExecWait, waitpid() failed");
+            throw system_error(errno, system_category(), "ForkExecWait, wait4() failed");
         }
+        return result;
     }
     else
     {
@@ -214,7 +778,7 @@ void util::ForkExecWait(char* args[], Task beforeExec)
     }
 }
 
-void util::ForkExecWaitTimeout(char* args[], Task beforeExec, unsigned int timeout_ms)
+ExecResult util::ForkExecWaitTimeout(char* args[], Task beforeExec, unsigned int timeout_ms)
 {
     pid_t timer_pid = fork();
     if (timer_pid == 0)
@@ -237,7 +801,7 @@ void util::ForkExecWaitTimeout(char* args[], Task beforeExec, unsigned int timeo
         beforeExec();
         execv(args[0], args);
         cerr << "Error in execv: " << strerror(errno) << endl;
-        exit(EXIT_FAILURE);
+        _exit(EXIT_FAILURE);
     }
     else if (child_pid < 0)
     {
@@ -245,24 +809,408 @@ void util::ForkExecWaitTimeout(char* args[], Task beforeExec, unsigned int timeo
         throw system_error(errno, system_category(), "ForkExecWaitTimeout, failed to fork() child process");
     }
     // Parent: wait
-    pid_t x = waitpid(-1, NULL, 0);
+    ExecResult result;
+    result.verdict = Verdict::Exited;
+    pid_t x = wait4(-1, &result.status, 0, &result.usage);
     if (x == child_pid)
     {
         kill(timer_pid, SIGKILL);
-        waitpid(-1, NULL, 0);
+        waitpid(timer_pid, NULL, 0);
     }
     else if (x == timer_pid)
     {
         kill(child_pid, SIGKILL);
-        waitpid(-1, NULL, 0);
+        wait4(child_pid, &result.status, 0, &result.usage);
+        result.verdict = Verdict::TimeLimit;
     }
     else
     {
         throw runtime_error("ForkExecWaitTimeout, Could not determine which child process exitted");
     }
+    return result;
 }
 
-void util::ForkCallWait(Task task)
+static const map<long, const char*> syscall_names = {
+#include "syscall_names.h"
+};
+
+string util::SyscallName(long nr)
+{
+    auto it = syscall_names.find(nr);
+    if (it == syscall_names.end())
+    {
+        return "syscall_" + to_string(nr);
+    }
+    return it->second;
+}
+
+void util::InstallSyscallTraceFilter()
+{
+    // Return SECCOMP_RET_TRACE with the system call number as data
+    struct sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+        BPF_STMT(BPF_ALU | BPF_AND | BPF_K, SECCOMP_RET_DATA),
+        BPF_STMT(BPF_ALU | BPF_OR | BPF_K, SECCOMP_RET_TRACE),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog;
+    prog.len = sizeof(filter) / sizeof(filter[0]);
+    prog.filter = filter;
+    // Required to install a filter without CAP_SYS_ADMIN
+    if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) < 0)
+    {
+        throw system_error(errno, system_category(), "InstallSyscallTraceFilter, prctl(PR_SET_NO_NEW_PRIVS) failed");
+    }
+    if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &prog) < 0)
+    {
+        throw system_error(errno, system_category(), "InstallSyscallTraceFilter, prctl(PR_SET_SECCOMP) failed");
+    }
+}
+
+static unsigned long long ElapsedNs(const struct timespec& start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec;
+}
+
+ExecResult util::ForkExecTrace(char* args[], Task beforeExec, unsigned int timeout_ms, SyscallProfile& profile)
+{
+    pid_t timer_pid = -1;
+    if (timeout_ms > 0)
+    {
+        timer_pid = fork();
+        if (timer_pid == 0)
+        {
+            struct timespec req;
+            req.tv_sec = timeout_ms / 1000;
+            req.tv_nsec = (timeout_ms % 1000) * 1000000;
+            nanosleep(&req, NULL);
+            _exit(0);
+        }
+        else if (timer_pid < 0)
+        {
+            throw system_error(errno, system_category(), "ForkExecTrace, failed to fork() timer process");
+        }
+    }
+    pid_t child_pid = fork();
+    if (child_pid == 0)
+    {
+        // Child: stop until the tracer has set its options
+        if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) < 0)
+        {
+            cerr << "Error in ptrace: " << strerror(errno) << endl;
+            _exit(EXIT_FAILURE);
+        }
+        raise(SIGSTOP);
+        beforeExec();
+        execv(args[0], args);
+        cerr << "Error in execv: " << strerror(errno) << endl;
+        _exit(EXIT_FAILURE);
+    }
+    else if (child_pid < 0)
+    {
+        throw system_error(errno, system_category(), "ForkExecTrace, failed to fork() child process");
+    }
+    int status;
+    if (waitpid(child_pid, &status, 0) < 0 || !WIFSTOPPED(status))
+    {
+        throw runtime_error("ForkExecTrace, child process did not stop");
+    }
+    long ptrace_options = PTRACE_O_TRACESECCOMP | PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC |
+                          PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE |
+                          PTRACE_O_EXITKILL;
+    if (ptrace(PTRACE_SETOPTIONS, child_pid, NULL, ptrace_options) < 0)
+    {
+        throw system_error(errno, system_category(), "ForkExecTrace, ptrace(PTRACE_SETOPTIONS) failed");
+    }
+    ptrace(PTRACE_CONT, child_pid, NULL, NULL);
+
+    struct Tracee
+    {
+        bool attach_stop_pending;   // New tracees start with a SIGSTOP
+        long syscall;               // The system call in progress or -1
+        struct timespec start;
+    };
+    map<pid_t, Tracee> tracees;
+    tracees[child_pid] = Tracee{false, -1, {}};
+
+    ExecResult result;
+    result.verdict = Verdict::Exited;
+    bool child_exited = false;
+    while (!child_exited)
+    {
+        struct rusage usage;
+        pid_t pid = wait4(-1, &status, __WALL, &usage);
+        if (pid < 0)
+        {
+            if (errno == EINTR) continue;
+            throw system_error(errno, system_category(), "ForkExecTrace, wait4() failed");
+        }
+        if (pid == timer_pid)
+        {
+            result.verdict = Verdict::TimeLimit;
+            timer_pid = -1;
+            for (auto& t : tracees)
+            {
+                kill(t.first, SIGKILL);
+            }
+            continue;
+        }
+        if (WIFEXITED(status) || WIFSIGNALED(status))
+        {
+            tracees.erase(pid);
+            if (pid == child_pid)
+            {
+                result.status = status;
+                result.usage = usage;
+                child_exited = true;
+            }
+            continue;
+        }
+        if (!WIFSTOPPED(status))
+        {
+            continue;
+        }
+        int signal = WSTOPSIG(status);
+        int event = status >> 16;
+        int deliver = 0;
+        auto it = tracees.find(pid);
+        if (it == tracees.end())
+        {
+            // Attach stop of a new tracee, reported before its parent's fork event
+            it = tracees.insert(make_pair(pid, Tracee{false, -1, {}})).first;
+        }
+        else if (event == PTRACE_EVENT_SECCOMP)
+        {
+            unsigned long nr;
+            ptrace(PTRACE_GETEVENTMSG, pid, NULL, &nr);
+            if (profile.size() <= nr)
+            {
+                profile.resize(nr + 1, SyscallStats{0, 0});
+            }
+            profile[nr].count++;
+            it->second.syscall = nr;
+            clock_gettime(CLOCK_MONOTONIC, &it->second.start);
+        }
+        else if (signal == (SIGTRAP | 0x80))
+        {
+            // System call exit, we only ask for these after a seccomp stop
+            if (it->second.syscall >= 0)
+            {
+                profile[it->second.syscall].total_ns += ElapsedNs(it->second.start);
+                it->second.syscall = -1;
+            }
+        }
+        else if (event == PTRACE_EVENT_FORK || event == PTRACE_EVENT_VFORK ||
+                 event == PTRACE_EVENT_CLONE)
+        {
+            unsigned long new_pid;
+            ptrace(PTRACE_GETEVENTMSG, pid, NULL, &new_pid);
+            if (tracees.count(new_pid) == 0)
+            {
+                tracees[new_pid] = Tracee{true, -1, {}};
+            }
+        }
+        else if (event == PTRACE_EVENT_EXEC)
+        {
+        }
+        else if (signal == SIGSTOP && it->second.attach_stop_pending)
+        {
+            it->second.attach_stop_pending = false;
+        }
+        else
+        {
+            deliver = signal;
+        }
+        // Errors are ignored here, the tracee may have been killed meanwhile
+        int request = (it->second.syscall >= 0) ? PTRACE_SYSCALL : PTRACE_CONT;
+        ptrace(static_cast<__ptrace_request>(request), pid, NULL, deliver);
+    }
+    for (auto& t : tracees)
+    {
+        kill(t.first, SIGKILL);
+        waitpid(t.first, NULL, __WALL);
+    }
+    if (timer_pid > 0)
+    {
+        kill(timer_pid, SIGKILL);
+        waitpid(timer_pid, NULL, 0);
+    }
+    return result;
+}
+
+unsigned long long util::NowMs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+ExecResult util::ForkExecMonitor(char* args[], Task beforeExec, unsigned int timeout_ms,
+                                 unsigned int interval_ms, Monitor monitor)
+{
+    // Blocked so that we can wait for SIGCHLD with a timeout
+    sigset_t sigchld, old_mask;
+    sigemptyset(&sigchld);
+    sigaddset(&sigchld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigchld, &old_mask);
+    pid_t child_pid = fork();
+    if (child_pid == 0)
+    {
+        // Child
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        beforeExec();
+        execv(args[0], args);
+        cerr << "Error in execv: " << strerror(errno) << endl;
+        _exit(EXIT_FAILURE);
+    }
+    else if (child_pid < 0)
+    {
+        // Error, in parent
+        int e = errno;
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        throw system_error(e, system_category(), "ForkExecMonitor, fork() failed");
+    }
+    // Parent: wait, waking up for the monitor and the timeout
+    ExecResult result;
+    result.verdict = Verdict::Exited;
+    unsigned long long start = NowMs();
+    unsigned long long next_call = start + interval_ms;
+    bool kill_child = false;
+    while (!kill_child)
+    {
+        pid_t x = wait4(child_pid, &result.status, WNOHANG, &result.usage);
+        if (x == child_pid)
+        {
+            break;
+        }
+        if (x < 0 && errno != EINTR)
+        {
+            int e = errno;
+            sigprocmask(SIG_SETMASK, &old_mask, NULL);
+            throw system_error(e, system_category(), "ForkExecMonitor, wait4() failed");
+        }
+        unsigned long long now = NowMs();
+        if (timeout_ms > 0 && now >= start + timeout_ms)
+        {
+            result.verdict = Verdict::TimeLimit;
+            kill_child = true;
+            continue;
+        }
+        if (now >= next_call)
+        {
+            next_call = now + interval_ms;
+            kill_child = !monitor(result.verdict);
+            continue;
+        }
+        unsigned long long wake = next_call;
+        if (timeout_ms > 0)
+        {
+            wake = min(wake, start + timeout_ms);
+        }
+        struct timespec wait_time;
+        wait_time.tv_sec = (wake - now) / 1000;
+        wait_time.tv_nsec = ((wake - now) % 1000) * 1000000;
+        sigtimedwait(&sigchld, NULL, &wait_time);
+    }
+    if (kill_child)
+    {
+        kill(child_pid, SIGKILL);
+        wait4(child_pid, &result.status, 0, &result.usage);
+    }
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return result;
+}
+
+/* Reads a small file of procfs into buffer as a C string */
+static bool ReadProcFile(int proc_fd, const string& path, char* buffer, size_t size)
+{
+    int fd = openat(proc_fd, path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;   // The process exited meanwhile
+    }
+    ssize_t n = read(fd, buffer, size - 1);
+    close(fd);
+    if (n <= 0)
+    {
+        return false;
+    }
+    buffer[n] = '\0';
+    return true;
+}
+
+ProcessStats util::SumProcessStats(int proc_fd)
+{
+    ProcessStats stats = ProcessStats();
+    static const long ticks_per_sec = sysconf(_SC_CLK_TCK);
+    static const long page_kb = sysconf(_SC_PAGESIZE) / 1024;
+    string self = to_string(getpid());
+    int dir_fd = dup(proc_fd);
+    DIR* dir = (dir_fd < 0) ? NULL : fdopendir(dir_fd);
+    if (dir == NULL)
+    {
+        if (dir_fd >= 0) close(dir_fd);
+        throw system_error(errno, system_category(), "SumProcessStats, fdopendir() failed");
+    }
+    rewinddir(dir);
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (!isdigit(entry->d_name[0]) || self == entry->d_name)
+        {
+            continue;
+        }
+        string pid = entry->d_name;
+        char buffer[4096];
+        if (!ReadProcFile(proc_fd, pid + "/stat", buffer, sizeof(buffer)))
+        {
+            continue;
+        }
+        // The command name may contain anything, the fields start after its ')'
+        char* fields = strrchr(buffer, ')');
+        unsigned long long utime, stime, cutime, cstime, rss;
+        if (fields == NULL ||
+            sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %llu %llu"
+                               " %*d %*d %*d %*d %*u %*u %llu",
+                   &utime, &stime, &cutime, &cstime, &rss) != 5)
+        {
+            continue;
+        }
+        stats.processes++;
+        stats.cpu_ms += (utime + stime + cutime + cstime) * 1000 / ticks_per_sec;
+        stats.rss_kb += rss * page_kb;
+        // Context switches are counted per thread
+        ScopedFd tasks(openat(proc_fd, (pid + "/task").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        for (auto& tid : tasks.fd < 0 ? vector<string>() : ListFolderAt(tasks.fd))
+        {
+            if (!ReadProcFile(tasks.fd, tid + "/status", buffer, sizeof(buffer)))
+            {
+                continue;
+            }
+            unsigned long long voluntary = 0, involuntary = 0;
+            if (char* line = strstr(buffer, "\nvoluntary_ctxt_switches:"))
+            {
+                sscanf(line, " voluntary_ctxt_switches: %llu nonvoluntary_ctxt_switches: %llu",
+                       &voluntary, &involuntary);
+            }
+            stats.voluntary_switches += voluntary;
+            stats.involuntary_switches += involuntary;
+        }
+        if (ReadProcFile(proc_fd, pid + "/io", buffer, sizeof(buffer)))
+        {
+            unsigned long long rchar = 0, wchar = 0;
+            sscanf(buffer, "rchar: %llu wchar: %llu", &rchar, &wchar);
+            stats.rchar += rchar;
+            stats.wchar += wchar;
+        }
+    }
+    closedir(dir);
+    return stats;
+}
+
+pid_t util::ForkCall(Task task)
 {
     pid_t pid = fork();
     if (pid == 0)
@@ -271,18 +1219,34 @@ void util::ForkCallWait(Task task)
         task();
         exit(EXIT_SUCCESS);
     }
-    else if (pid > 0)
+    else if (pid < 0)
     {
-        // Parent
-        if (waitpid(pid, NULL, 0) < 0)
-        {
-            throw system_error(errno, system_category(), "ForkCallWait, waitpid() failed");
-        }
+        throw system_error(errno, system_category(), "ForkCall, fork() failed");
     }
-    else
+    return pid;
+}
+
+void util::ForkCallWait(Task task)
+{
+    WaitPid(ForkCall(task));
+}
+
+void util::WaitPid(pid_t pid)
+{
+    if (waitpid(pid, NULL, 0) < 0)
+    {
+        throw system_error(errno, system_category(), "WaitPid, waitpid() failed");
+    }
+}
+
+void util::KillAllProcesses()
+{
+    if (kill(-1, SIGKILL) < 0 && errno != ESRCH)
+    {
+        throw system_error(errno, system_category(), "KillAllProcesses, kill() failed");
+    }
+    while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
     {
-        // Error, in parent
-        throw system_error(errno, system_category(), "ForkCallWait, fork() failed");
     }
 }
 
@@ -2,7 +2,11 @@
 #define _UTIL_D9E2673EFADA464D9659570557AD587E
 
 #include <string>
+#include <vector>
 #include <functional>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <sys/mount.h>
 
 namespace util
 {
@@ -14,6 +18,10 @@ namespace util
 
     std::string BaseName(std::string path);
 
+    /* Prepends the working folder to relative paths, symbolic links are
+     * not resolved */
+    std::string AbsolutePath(std::string path);
+
     void DeleteFile(std::string path);
 
     /* Fails if the folder is not empty */
@@ -21,35 +29,181 @@ namespace util
 
     void ChangeMode(std::string path, unsigned short mode);
 
+    uid_t PathOwner(std::string path);
+
+    time_t PathModificationTime(std::string path);
+
+    /* Returns the names of the entries in the folder, except . and .. */
+    std::vector<std::string> ListFolder(std::string path);
+
+    /* Deletes the folder and everything under it. Symbolic links are not
+     * followed and other file systems mounted under path are not entered */
+    void DeleteFolderTree(std::string path);
+
+    /* Takes an exclusive flock() on path and returns the locked file
+     * descriptor, or -1 if someone else holds the lock. The lock is released
+     * when the returned descriptor (and all its copies) are closed */
+    int LockPath(std::string path);
+
     /* Returns the actual folder path that is created after
      * appending 6 random characters to path_prefix */
     std::string CreateTempFolder(std::string path_prefix);
 
     void CreateFolder(std::string path, unsigned short mode = 0755);
 
-    /* Both source and dest must exist. Requires root */
-    void BindMount(std::string source, std::string dest);
+    /* dest must not exist. Shares the data blocks if the file system supports
+     * it, otherwise the data is copied by the kernel. The permissions are
+     * preserved, set-user-ID, set-group-ID and sticky bits are not */
+    void CopyFile(std::string source, std::string dest);
+
+    /* Copies the data of in_fd to out_fd the way CopyFile does */
+    void CopyFileData(int in_fd, int out_fd);
+
+    /* Moves the folders and regular files in the folder opened as source_fd
+     * into the one opened as dest_fd with rename(), with the real user's
+     * permissions. Where that fails (e.g. a folder exists in both, which are
+     * merged) they are copied the way CopyFile does, overwriting existing
+     * files. What is moved is handed over to the real user without
+     * set-user-ID bits, symbolic links and special files are deleted.
+     * Returns 0, or the errno of the first entry that could not be moved
+     * (e.g. a file where dest has a folder), which is left in source.
+     * Nothing else may modify source meanwhile */
+    int MoveFolderAsRealUser(int source_fd, int dest_fd);
+
+    /* Bytes used by the folder opened as folder_fd and everything in it,
+     * the larger of the size and the allocated blocks of each file. Entries
+     * deleted meanwhile are skipped */
+    unsigned long long FolderUsage(int folder_fd);
+
+    /* Deletes everything in the folder opened as folder_fd, without
+     * following symbolic links */
+    void DeleteFolderContents(int folder_fd);
+
+    /* Both source and dest must exist. flags are applied to the new mount,
+     * which is read-only by default. Requires root */
+    void BindMount(std::string source, std::string dest, unsigned long flags = MS_RDONLY);
 
     void Unmount(std::string dest);
 
+    /* Lazily detaches dest, returns false if dest is not a mount point */
+    bool TryUnmount(std::string dest);
+
     void MarkMountPointPrivate(std::string path);
 
     void CreatePrivateMount(std::string path);
 
     void MountSpecialFileSystem(std::string path, std::string fs);
 
+    /* options are passed to tmpfs as is, e.g. "size=64m,mode=1777" */
+    void MountTmpfs(std::string path, std::string options);
+
+    /* Mounts a procfs for our PID namespace at mount_point, which must not
+     * exist, and detaches it right away. Returns a descriptor of its root,
+     * through which it stays usable */
+    int OpenPrivateProcfs(std::string mount_point);
+
     void Chroot(std::string new_root);
 
     void Chdir(std::string path);
 
+    /* Both ends are created with O_CLOEXEC */
+    void CreatePipe(int fds[2]);
+
+    void Close(int fd);
+
+    /* Closes all file descriptors above stderr except the ones in keep */
+    void CloseAllFdsExcept(const std::vector<int>& keep);
+
+    void WriteAll(int fd, const void* buffer, size_t size);
+
+    /* Returns false if end of file is reached before size bytes are read */
+    bool ReadAll(int fd, void* buffer, size_t size);
+
+    /* Points stdin, stdout and optionally stderr to fd */
+    void RedirectStdio(int fd, bool keep_stderr);
+
+    /* Runs task with the effective uid/gid temporarily set to the real
+     * uid/gid, e.g. to create files on behalf of the user running us */
+    void RunAsRealUser(std::function<void(void)> task);
+
+    /* Opens path with the real user's permissions, O_CLOEXEC is implied */
+    int OpenAsRealUser(std::string path, int flags);
+
+    enum class Verdict { Exited, TimeLimit, Invalid, Killed, Idle, OutputLimit };
+
+    struct ExecResult
+    {
+        int status;             // As reported by wait4()
+        struct rusage usage;
+        Verdict verdict;
+        int output_error = 0;   // errno of moving the program's output, if any
+    };
+
     using Task = std::function<void(void)>;
 
-    void ForkExecWait(char* args[], Task beforeExec);
+    /* beforeExec runs in the child, which must leave with _exit() so that
+     * stdio streams shared with the parent are not flushed or rewound */
+    ExecResult ForkExecWait(char* args[], Task beforeExec);
+
+    ExecResult ForkExecWaitTimeout(char* args[], Task beforeExec, unsigned int timeout_ms);
+
+    /* Milliseconds since some fixed point, not affected by clock changes */
+    unsigned long long NowMs();
+
+    /* Returns false to have the child killed, with verdict set to the reason */
+    using Monitor = std::function<bool(Verdict& verdict)>;
+
+    /* Like ForkExecWaitTimeout, and also calls monitor every interval_ms
+     * while the child runs. timeout_ms can be 0 */
+    ExecResult ForkExecMonitor(char* args[], Task beforeExec, unsigned int timeout_ms,
+                               unsigned int interval_ms, Monitor monitor);
+
+    struct ProcessStats
+    {
+        unsigned long processes;
+        unsigned long long cpu_ms;  // User and system time
+        unsigned long long rss_kb;
+        unsigned long long voluntary_switches;     // Of all threads
+        unsigned long long involuntary_switches;
+        unsigned long long rchar;   // Bytes passed to read() and the like, pipes included
+        unsigned long long wchar;
+    };
 
-    void ForkExecWaitTimeout(char* args[], Task beforeExec, unsigned int timeout_ms);
+    /* Sums up the processes in the procfs opened as proc_fd, except us.
+     * Reaped processes count in the CPU time and I/O of their parents */
+    ProcessStats SumProcessStats(int proc_fd);
+
+    struct SyscallStats
+    {
+        unsigned long count;
+        unsigned long long total_ns;
+    };
+
+    /* Indexed by system call number */
+    using SyscallProfile = std::vector<SyscallStats>;
+
+    std::string SyscallName(long nr);
+
+    /* Makes every system call of the calling process and its future children
+     * stop for the tracer. Meant to be called from ForkExecTrace's beforeExec */
+    void InstallSyscallTraceFilter();
+
+    /* Like ForkExecWaitTimeout, but traces the child and its descendants and
+     * adds the count and duration of their system calls to profile. Leftover
+     * descendants are killed when the child exits. timeout_ms can be 0 */
+    ExecResult ForkExecTrace(char* args[], Task beforeExec, unsigned int timeout_ms, SyscallProfile& profile);
+
+    /* Does not wait for the child, returns its pid */
+    pid_t ForkCall(Task task);
 
     void ForkCallWait(Task task);
 
+    void WaitPid(pid_t pid);
+
+    /* Kills every process we are allowed to signal except ourselves, and
+     * reaps all our children. Meant for the init of a PID namespace */
+    void KillAllProcesses();
+
     void Unshare(int flags);
 }
 